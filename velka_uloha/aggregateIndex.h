@@ -0,0 +1,144 @@
+//
+// Aggregate index over the number lane, used by sum, count, min and max on tall ranges.
+//
+
+#ifndef VELKA_ULOHA_AGGREGATEINDEX_H
+#define VELKA_ULOHA_AGGREGATEINDEX_H
+
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+#include "cellGrid.h"
+
+// Every column is covered by a 64-ary tree of blocks: a level 0 block spans 64 rows of the column
+// (one tile column), a level L block spans 64 blocks of level L - 1. Summaries are computed on first
+// use and dropped along the path to the root when a cell of the column changes, so a write costs one
+// erase per level and a query over n rows touches O(64 log_64 n) summaries and cells. A range spanning more
+// tile rows than the grid has tiles is mostly empty, it is scanned through the stored tiles instead, and
+// blocks without a tile are never summarized, so a sparse column costs what its tiles do.
+class ColumnAggregateIndex {
+public:
+    struct Summary {
+        double sum = 0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+        size_t count = 0;
+
+        void add(double x) {
+            sum += x;
+            min = std::min(min, x);
+            max = std::max(max, x);
+            count++;
+        }
+        void merge(const Summary& other) {
+            sum += other.sum;
+            min = std::min(min, other.min);
+            max = std::max(max, other.max);
+            count += other.count;
+        }
+    };
+
+    static constexpr int FANOUT_BITS = CellGrid<double>::TILE_BITS;
+    // Six levels of 64-ary blocks cover all 2^32 rows
+    static constexpr int LEVELS = 6;
+    // Shorter ranges are cheaper to scan directly
+    static constexpr int MIN_ROWS = 4 << FANOUT_BITS;
+
+    // Drops the summaries covering the cell, called whenever a number is written or removed.
+    void invalidate(const std::pair<int, int>& pos) {
+        for (int level = 0; level < LEVELS; ++level) {
+            m_blocks[level].erase(blockKey(blockIndex(pos.first, level), pos.second));
+        }
+    }
+
+    void clear() {
+        for (auto& level : m_blocks) {
+            level.clear();
+        }
+    }
+
+    // While shared, summaries that are missing are computed without being stored, so several threads
+    // may query at once as long as nobody writes to the sheet meanwhile. Whoever shares the index
+    // builds the summaries the threads need first, by running their queries before.
+    void setShared(bool shared) {
+        m_shared = shared;
+    }
+
+    // Summarizes the numbers in rows top..bottom of column col.
+    Summary query(const CellGrid<double>& numbers, int top, int bottom, int col) const {
+        Summary total;
+        if ((bottom >> FANOUT_BITS) - (top >> FANOUT_BITS) + 1 > static_cast<long long>(numbers.tileCount())) {
+            addCells(numbers, top, bottom, col, total);
+            return total;
+        }
+        long long row = top;
+        while (row <= bottom) {
+            // Take the largest block that starts at row and still fits in the range
+            int level = -1;
+            while (level + 1 < LEVELS) {
+                long long size = blockSize(level + 1);
+                if ((row & (size - 1)) != 0 || row + size - 1 > bottom) {
+                    break;
+                }
+                level++;
+            }
+            if (level < 0) {
+                long long end = std::min<long long>(bottom, row | (blockSize(0) - 1));
+                addCells(numbers, static_cast<int>(row), static_cast<int>(end), col, total);
+                row = end + 1;
+            } else {
+                total.merge(block(numbers, level, blockIndex(static_cast<int>(row), level), col));
+                row += blockSize(level);
+            }
+        }
+        return total;
+    }
+
+private:
+    static long long blockSize(int level) {
+        return 1LL << (FANOUT_BITS * (level + 1));
+    }
+    static long long blockIndex(int row, int level) {
+        return static_cast<long long>(row) >> (FANOUT_BITS * (level + 1));
+    }
+    static long long blockKey(long long index, int col) {
+        return (index << 32) | static_cast<unsigned>(col);
+    }
+
+    static void addCells(const CellGrid<double>& numbers, int top, int bottom, int col, Summary& summary) {
+        numbers.forEachSpan(top, col, bottom - top + 1, 1, [&](const std::pair<int, int>&, const double* cells, const unsigned char* used, int) {
+            if (*used) {
+                summary.add(*cells);
+            }
+        });
+    }
+
+    Summary block(const CellGrid<double>& numbers, int level, long long index, int col) const {
+        auto& blocks = m_blocks[level];
+        auto it = blocks.find(blockKey(index, col));
+        if (it != blocks.end()) {
+            return it->second;
+        }
+        Summary summary;
+        if (level == 0) {
+            if (!numbers.hasTile(static_cast<int>(index), col >> FANOUT_BITS)) {
+                return summary;
+            }
+            long long top = index << FANOUT_BITS;
+            addCells(numbers, static_cast<int>(top), static_cast<int>(top + blockSize(0) - 1), col, summary);
+        } else {
+            for (long long child = index << FANOUT_BITS; child < (index + 1) << FANOUT_BITS; ++child) {
+                summary.merge(block(numbers, level - 1, child, col));
+            }
+        }
+        if (!m_shared) {
+            blocks.emplace(blockKey(index, col), summary);
+        }
+        return summary;
+    }
+
+    mutable std::unordered_map<long long, Summary> m_blocks[LEVELS];
+    bool m_shared = false;
+};
+
+#endif //VELKA_ULOHA_AGGREGATEINDEX_H
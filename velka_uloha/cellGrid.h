@@ -0,0 +1,255 @@
+//
+// Sparse cell storage split into dense 64x64 tiles.
+//
+
+#ifndef VELKA_ULOHA_CELLGRID_H
+#define VELKA_ULOHA_CELLGRID_H
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+template<typename T>
+class CellGrid {
+public:
+    static constexpr int TILE_BITS = 6;
+    static constexpr int TILE_SIZE = 1 << TILE_BITS;
+    static constexpr int TILE_MASK = TILE_SIZE - 1;
+
+    struct Row {
+        std::array<T, TILE_SIZE> cells{};
+        // One byte per cell rather than a bitset, so span loops can read it without bit twiddling
+        std::array<unsigned char, TILE_SIZE> used{};
+        int count = 0;
+    };
+    // Rows are allocated with their first cell, so a sparse tile costs a row rather than the whole block
+    struct Tile {
+        std::array<std::unique_ptr<Row>, TILE_SIZE> rows;
+        int count = 0;
+
+        Tile() = default;
+        Tile(const Tile& other) : count(other.count) {
+            for (int r = 0; r < TILE_SIZE; ++r) {
+                if (other.rows[r]) {
+                    rows[r] = std::make_unique<Row>(*other.rows[r]);
+                }
+            }
+        }
+    };
+
+    // A copy shares the tiles of the grid it was copied from, a shared tile is copied the first time either
+    // of them writes to it. So a copy costs a pointer per tile, and reading a copy on another thread
+    // is safe while the original goes on changing.
+    CellGrid() = default;
+    CellGrid(const CellGrid& other) = default;
+    CellGrid(CellGrid&& other) noexcept = default;
+    CellGrid& operator=(CellGrid other) {
+        m_tiles.swap(other.m_tiles);
+        std::swap(m_count, other.m_count);
+        return *this;
+    }
+
+    // Returns the stored value or nullptr when the cell is empty.
+    const T* find(const std::pair<int, int>& pos) const {
+        const Tile* tile = findTile(pos.first >> TILE_BITS, pos.second >> TILE_BITS);
+        if (!tile) {
+            return nullptr;
+        }
+        const Row* row = tile->rows[pos.first & TILE_MASK].get();
+        int col = pos.second & TILE_MASK;
+        return row && row->used[col] ? &row->cells[col] : nullptr;
+    }
+    // Returns the stored value, creating an empty one if needed.
+    T& operator[](const std::pair<int, int>& pos) {
+        auto& tile = m_tiles[tileKey(pos.first >> TILE_BITS, pos.second >> TILE_BITS)];
+        if (!tile) {
+            tile = std::make_shared<Tile>();
+        }
+        unshare(tile);
+        auto& row = tile->rows[pos.first & TILE_MASK];
+        if (!row) {
+            row = std::make_unique<Row>();
+        }
+        int col = pos.second & TILE_MASK;
+        if (!row->used[col]) {
+            row->used[col] = true;
+            row->count++;
+            tile->count++;
+            m_count++;
+        }
+        return row->cells[col];
+    }
+
+    bool erase(const std::pair<int, int>& pos) {
+        auto it = m_tiles.find(tileKey(pos.first >> TILE_BITS, pos.second >> TILE_BITS));
+        if (it == m_tiles.end()) {
+            return false;
+        }
+        const Row* row = it->second->rows[pos.first & TILE_MASK].get();
+        if (!row || !row->used[pos.second & TILE_MASK]) {
+            return false;
+        }
+        eraseLocal(it, pos.first & TILE_MASK, pos.second & TILE_MASK);
+        return true;
+    }
+
+    void clear() {
+        m_tiles.clear();
+        m_count = 0;
+    }
+
+    size_t size() const {
+        return m_count;
+    }
+    size_t tileCount() const {
+        return m_tiles.size();
+    }
+    bool hasTile(int tileRow, int tileCol) const {
+        return findTile(tileRow, tileCol) != nullptr;
+    }
+
+    // Visits all stored cells as fn(pos, value), tile by tile in row-major order.
+    template<typename F>
+    void forEach(F&& fn) const {
+        std::vector<std::pair<int, int>> keys;
+        keys.reserve(m_tiles.size());
+        for (const auto& [key, tile] : m_tiles) {
+            keys.emplace_back(static_cast<int>(key >> 32), static_cast<int>(key & 0xffffffff));
+        }
+        std::sort(keys.begin(), keys.end());
+        for (const auto& [tileRow, tileCol] : keys) {
+            const Tile& tile = *m_tiles.find(tileKey(tileRow, tileCol))->second;
+            for (int r = 0; r < TILE_SIZE; ++r) {
+                const Row* row = tile.rows[r].get();
+                for (int c = 0; row && c < TILE_SIZE; ++c) {
+                    if (row->used[c]) {
+                        fn(std::pair<int, int>((tileRow << TILE_BITS) + r, (tileCol << TILE_BITS) + c), row->cells[c]);
+                    }
+                }
+            }
+        }
+    }
+
+    // Visits the h x w rectangle at (row, col) as contiguous row spans of existing tiles,
+    // fn(start, cells, used, len) gets pointers to len consecutive cells starting at start.
+    // Tiles are walked one at a time, so each is looked up once and missing ones are skipped whole.
+    // A rectangle covering more tiles than the grid has goes through the stored tiles instead.
+    template<typename F>
+    void forEachSpan(int row, int col, int h, int w, F&& fn) const {
+        if (h <= 0 || w <= 0) {
+            return;
+        }
+        int lastRow = row + h - 1;
+        int lastCol = col + w - 1;
+        auto visit = [&](int tileRow, int tileCol, const Tile& tile) {
+            int fromRow = std::max(row, tileRow << TILE_BITS);
+            int toRow = std::min(lastRow, (tileRow << TILE_BITS) + TILE_MASK);
+            int fromCol = std::max(col, tileCol << TILE_BITS);
+            int toCol = std::min(lastCol, (tileCol << TILE_BITS) + TILE_MASK);
+            for (int r = fromRow; r <= toRow; ++r) {
+                const Row* cells = tile.rows[r & TILE_MASK].get();
+                if (cells) {
+                    int base = fromCol & TILE_MASK;
+                    fn(std::pair<int, int>(r, fromCol), &cells->cells[base], &cells->used[base], toCol - fromCol + 1);
+                }
+            }
+        };
+        long long tileRows = (lastRow >> TILE_BITS) - (row >> TILE_BITS) + 1;
+        long long tileCols = (lastCol >> TILE_BITS) - (col >> TILE_BITS) + 1;
+        if (tileRows * tileCols > static_cast<long long>(m_tiles.size())) {
+            std::vector<std::pair<int, int>> keys;
+            for (const auto& [key, tile] : m_tiles) {
+                int tileRow = static_cast<int>(key >> 32);
+                int tileCol = static_cast<int>(key & 0xffffffff);
+                if (tileRow >= row >> TILE_BITS && tileRow <= lastRow >> TILE_BITS
+                    && tileCol >= col >> TILE_BITS && tileCol <= lastCol >> TILE_BITS) {
+                    keys.emplace_back(tileRow, tileCol);
+                }
+            }
+            std::sort(keys.begin(), keys.end());
+            for (const auto& [tileRow, tileCol] : keys) {
+                visit(tileRow, tileCol, *findTile(tileRow, tileCol));
+            }
+            return;
+        }
+        for (int tileRow = row >> TILE_BITS; tileRow <= lastRow >> TILE_BITS; ++tileRow) {
+            for (int tileCol = col >> TILE_BITS; tileCol <= lastCol >> TILE_BITS; ++tileCol) {
+                if (const Tile* tile = findTile(tileRow, tileCol)) {
+                    visit(tileRow, tileCol, *tile);
+                }
+            }
+        }
+    }
+
+    // Visits stored cells of the h x w rectangle at (row, col) as fn(pos, value).
+    template<typename F>
+    void forEachInRect(int row, int col, int h, int w, F&& fn) const {
+        forEachSpan(row, col, h, w, [&](const std::pair<int, int>& start, const T* cells, const unsigned char* used, int len) {
+            for (int k = 0; k < len; ++k) {
+                if (used[k]) {
+                    fn(std::pair<int, int>(start.first, start.second + k), cells[k]);
+                }
+            }
+        });
+    }
+
+    // Removes all cells of the h x w rectangle at (row, col), dropping tiles that become empty.
+    void eraseRect(int row, int col, int h, int w) {
+        std::vector<std::pair<int, int>> stored;
+        forEachInRect(row, col, h, w, [&](const std::pair<int, int>& pos, const T&) {
+            stored.push_back(pos);
+        });
+        for (const auto& pos : stored) {
+            erase(pos);
+        }
+    }
+
+private:
+    static long long tileKey(int tileRow, int tileCol) {
+        return (static_cast<long long>(tileRow) << 32) | static_cast<unsigned>(tileCol);
+    }
+    const Tile* findTile(int tileRow, int tileCol) const {
+        auto it = m_tiles.find(tileKey(tileRow, tileCol));
+        return it == m_tiles.end() ? nullptr : it->second.get();
+    }
+
+    using tileMap = std::unordered_map<long long, std::shared_ptr<Tile>>;
+
+    // Makes the tile this grid's own before it is written. use_count is a relaxed load, so once it shows the
+    // tile is no longer shared, the fence pairs with the releasing decrement of the thread that dropped the
+    // other copy. Its last reads of the tile then happen before the writes here.
+    static void unshare(std::shared_ptr<Tile>& tile) {
+        if (tile.use_count() > 1) {
+            tile = std::make_shared<Tile>(*tile);
+        } else {
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+    }
+
+    // Releases the row and then the tile once their last cell is gone.
+    void eraseLocal(typename tileMap::iterator it, int r, int c) {
+        unshare(it->second);
+        Tile& tile = *it->second;
+        Row& row = *tile.rows[r];
+        row.used[c] = false;
+        row.cells[c] = T();
+        row.count--;
+        tile.count--;
+        m_count--;
+        if (row.count == 0) {
+            tile.rows[r].reset();
+        }
+        if (tile.count == 0) {
+            m_tiles.erase(it);
+        }
+    }
+
+    tileMap m_tiles;
+    size_t m_count = 0;
+};
+
+#endif //VELKA_ULOHA_CELLGRID_H
@@ -0,0 +1,149 @@
+//
+// Compact cell handles and the tables of texts and formulas they point into.
+//
+
+#ifndef VELKA_ULOHA_CELLHANDLE_H
+#define VELKA_ULOHA_CELLHANDLE_H
+
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+// A stored text or formula in 8 bytes: a tag for its kind in the top two bits and the index into its table
+// in the low 32. A default handle has neither tag. Numbers are not boxed into handles, they stay in the dense
+// number lane, where aggregates and column blocks read them as plain doubles.
+class CellHandle {
+public:
+    CellHandle() = default;
+
+    static CellHandle text(uint32_t index) {
+        return CellHandle(TEXT_TAG | index);
+    }
+    static CellHandle formula(uint32_t index) {
+        return CellHandle(FORMULA_TAG | index);
+    }
+
+    bool isText() const {
+        return (m_bits & TAG_MASK) == TEXT_TAG;
+    }
+    bool isFormula() const {
+        return (m_bits & TAG_MASK) == FORMULA_TAG;
+    }
+    uint32_t index() const {
+        return static_cast<uint32_t>(m_bits);
+    }
+
+private:
+    explicit CellHandle(uint64_t bits) : m_bits(bits) {}
+
+    static constexpr uint64_t TAG_MASK = 3ULL << 62;
+    static constexpr uint64_t TEXT_TAG = 1ULL << 62;
+    static constexpr uint64_t FORMULA_TAG = 2ULL << 62;
+
+    uint64_t m_bits = 0;
+};
+
+static_assert(sizeof(CellHandle) == 8);
+
+// Values cells refer to by index, each stored once: equal texts share an entry, and so do the cells
+// sharing a program. An entry counts the cells referring to it and its slot is reused once none does.
+// KeyOf gives the key of a value, which may point into the value itself.
+template<typename T, typename Key, typename KeyOf>
+class InternTable {
+public:
+    InternTable() = default;
+    // Entries never move, but the keys of a copy have to point into its own entries
+    InternTable(const InternTable& other) : m_entries(other.m_entries), m_free(other.m_free) {
+        for (uint32_t i = 0; i < m_entries.size(); ++i) {
+            if (m_entries[i].refs) {
+                m_index.emplace(KeyOf()(m_entries[i].value), i);
+            }
+        }
+    }
+    InternTable(InternTable&& other) noexcept = default;
+    InternTable& operator=(InternTable other) {
+        m_entries.swap(other.m_entries);
+        m_free.swap(other.m_free);
+        m_index.swap(other.m_index);
+        return *this;
+    }
+
+    // Returns the index of value, storing it first if it is new, and counts one more reference to it.
+    uint32_t acquire(T value) {
+        auto found = m_index.find(KeyOf()(value));
+        if (found != m_index.end()) {
+            m_entries[found->second].refs++;
+            return found->second;
+        }
+        uint32_t index;
+        if (m_free.empty()) {
+            index = static_cast<uint32_t>(m_entries.size());
+            m_entries.push_back({std::move(value), 1});
+        } else {
+            index = m_free.back();
+            m_free.pop_back();
+            m_entries[index] = {std::move(value), 1};
+        }
+        m_index.emplace(KeyOf()(m_entries[index].value), index);
+        return index;
+    }
+
+    void addRef(uint32_t index) {
+        m_entries[index].refs++;
+    }
+
+    void release(uint32_t index) {
+        Entry& entry = m_entries[index];
+        if (--entry.refs == 0) {
+            m_index.erase(KeyOf()(entry.value));
+            entry.value = T();
+            m_free.push_back(index);
+        }
+    }
+
+    const T& operator[](uint32_t index) const {
+        return m_entries[index].value;
+    }
+
+    // Puts an equivalent value under the same index, such as a program moved to another buffer.
+    void replace(uint32_t index, T value) {
+        Entry& entry = m_entries[index];
+        m_index.erase(KeyOf()(entry.value));
+        entry.value = std::move(value);
+        m_index.emplace(KeyOf()(entry.value), index);
+    }
+
+    // Visits the entries some cell refers to as fn(index, value).
+    template<typename F>
+    void forEach(F&& fn) const {
+        for (uint32_t i = 0; i < m_entries.size(); ++i) {
+            if (m_entries[i].refs) {
+                fn(i, m_entries[i].value);
+            }
+        }
+    }
+
+    size_t size() const {
+        return m_index.size();
+    }
+
+    void clear() {
+        m_entries.clear();
+        m_free.clear();
+        m_index.clear();
+    }
+
+private:
+    struct Entry {
+        T value;
+        size_t refs;
+    };
+
+    // A deque, so keys pointing into the values stay valid while entries are added
+    std::deque<Entry> m_entries;
+    std::vector<uint32_t> m_free;
+    std::unordered_map<Key, uint32_t> m_index;
+};
+
+#endif //VELKA_ULOHA_CELLHANDLE_H
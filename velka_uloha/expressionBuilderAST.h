@@ -18,16 +18,30 @@ std::string numberToLetters(int index) {
     return result;
 }
 
-std::string parseAndAdjustExpression(const std::string& expr, int deltaRow, int deltaCol) {
-    std::string result;
+// Copies expr to result with every cell reference replaced by what rewrite appends for it, given the
+// column letters and row digits of the reference with their '$' flags. String literals, function names
+// and exponents of number literals are copied as they are.
+template<typename Rewrite>
+void rewriteReferences(std::string_view expr, std::string& result, Rewrite rewrite) {
     size_t i = 0;
 
     while (i < expr.length()) {
-        if (std::isalpha(expr[i]) || (expr[i] == '$' && i + 1 < expr.length() && std::isalpha(expr[i + 1]))) {
+        if (expr[i] == '"') {
+            // Copy string literals untouched, doubled quotes stay inside the literal
+            size_t j = i + 1;
+            while (j < expr.length() && (expr[j] != '"' || (j + 1 < expr.length() && expr[j + 1] == '"'))) {
+                j += expr[j] == '"' ? 2 : 1;
+            }
+            j = std::min(j + 1, expr.length());
+            result.append(expr, i, j - i);
+            i = j;
+        } else if (std::isalpha(expr[i]) && i > 0 && (std::isdigit(expr[i - 1]) || expr[i - 1] == '.')) {
+            // Exponent of a number literal such as 5e1
+            result.push_back(expr[i]);
+            ++i;
+        } else if (std::isalpha(expr[i]) || (expr[i] == '$' && i + 1 < expr.length() && std::isalpha(expr[i + 1]))) {
             bool colAbsolute = false;
             bool rowAbsolute = false;
-            std::string col;
-            std::string rowStr;
             size_t j = i;
 
             // Check for absolute column reference
@@ -37,10 +51,11 @@ std::string parseAndAdjustExpression(const std::string& expr, int deltaRow, int
             }
 
             // Collect column letters
+            size_t colStart = j;
             while (j < expr.length() && std::isalpha(expr[j])) {
-                col.push_back(expr[j]);
                 ++j;
             }
+            std::string_view col = expr.substr(colStart, j - colStart);
 
             // Check for absolute row reference
             if (j < expr.length() && expr[j] == '$') {
@@ -49,29 +64,20 @@ std::string parseAndAdjustExpression(const std::string& expr, int deltaRow, int
             }
 
             // Collect row number
+            size_t rowStart = j;
             while (j < expr.length() && std::isdigit(expr[j])) {
-                rowStr.push_back(expr[j]);
                 ++j;
             }
+            std::string_view row = expr.substr(rowStart, j - rowStart);
 
-            // Convert column to index and row to 0-based index
-            int colIndex = letterToNumber(col);
-            int row = std::stoi(rowStr) - 1;
-
-            // Adjust row and column based on deltaRow and deltaCol if not absolute
-            if (!rowAbsolute) {
-                row += deltaRow;
-            }
-            if (!colAbsolute) {
-                colIndex += deltaCol;
+            // Letters without a row number are a function name, keep them as they are
+            if (row.empty()) {
+                result.append(expr, i, j - i);
+                i = j;
+                continue;
             }
 
-            // Convert back to spreadsheet notation
-            col = colAbsolute ? "$" + numberToLetters(colIndex) : numberToLetters(colIndex);
-            rowStr = rowAbsolute ? "$" + std::to_string(row + 1) : std::to_string(row + 1);
-
-            // Append adjusted reference to result
-            result += col + rowStr;
+            rewrite(result, colAbsolute, col, rowAbsolute, row);
             i = j; // Move index to the end of the number
         } else {
             // Append normal characters
@@ -79,454 +85,698 @@ std::string parseAndAdjustExpression(const std::string& expr, int deltaRow, int
             ++i;
         }
     }
+}
 
+// Returns the formula at (row, col) with its relative references written as offsets from the cell, so
+// formulas that compile to the same program get the same key wherever they are. Gives nothing for
+// formulas whose references are out of range or whose text contains the marker of a reference.
+std::optional<std::string> templateKey(std::string_view expr, int row, int col) {
+    constexpr char MARKER = '\x01';
+    if (expr.find(MARKER) != std::string_view::npos) {
+        return std::nullopt;
+    }
+    bool valid = true;
+    std::string result;
+    rewriteReferences(expr, result, [&](std::string& out, bool colAbsolute, std::string_view colStr,
+                                        bool rowAbsolute, std::string_view rowStr) {
+        int refRow = 0;
+        auto [end, error] = std::from_chars(rowStr.data(), rowStr.data() + rowStr.size(), refRow);
+        if (colStr.size() > 6 || error != std::errc()) {
+            valid = false;
+            return;
+        }
+        int refCol = letterToNumber(colStr);
+        out += MARKER;
+        out += colAbsolute ? "$" + std::to_string(refCol) : std::to_string(static_cast<long long>(refCol) - col);
+        out += ',';
+        out += rowAbsolute ? "$" + std::to_string(refRow) : std::to_string(static_cast<long long>(refRow) - row);
+        out += MARKER;
+    });
+    if (!valid) {
+        return std::nullopt;
+    }
     return result;
 }
 
 using ExpressionResult = std::variant<std::monostate, double, std::string>;
-
-class ExprNode {
-public:
-    std::string strExpr;
-    virtual ~ExprNode() = default;
-    virtual ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const = 0;
-    virtual std::shared_ptr<ExprNode> clone() const = 0;
-};
-
-
-class NumberNode : public ExprNode {
-    ExpressionResult value;
-public:
-    explicit NumberNode(double val) : value(val) {}
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        return value;
+inline Operand toOperand(ExpressionResult val) {
+    if (const double* num = std::get_if<double>(&val)) {
+        return *num;
+    } else if (std::string* str = std::get_if<std::string>(&val)) {
+        return std::move(*str);
     }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<NumberNode>(*this);
-    }
-};
+    return Operand();
+}
 
-class StringNode : public ExprNode {
-    ExpressionResult value;
-public:
-    explicit StringNode(std::string val) : value(val) {}
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        return value;
-    }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<StringNode>(*this);
+inline ExpressionResult toResult(Operand val) {
+    if (const double* num = std::get_if<double>(&val)) {
+        return *num;
+    } else if (std::string* str = std::get_if<std::string>(&val)) {
+        return std::move(*str);
+    } else if (const std::string_view* view = std::get_if<std::string_view>(&val)) {
+        return std::string(*view);
     }
-};
-
-class ValReferenceNode : public ExprNode {
-    bool hAbs;
-    bool wAbs;
-    int posH;
-    int posW;
-public:
-    ValReferenceNode(bool hAbsolute, bool wAbsolute, int hPosition, int wPosition)
-            : hAbs(hAbsolute), wAbs(wAbsolute), posH(hPosition), posW(wPosition) {}
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        globalCount++;
-        if (globalCount > 60) {return CValue();}
-        std::pair<int, int> pos;
-        pos.first = hAbs ? posH : row + posH;
-        pos.second = wAbs ? posW : col + posW;
-
-
-        auto it = context.m_table.find(pos);
-        if (it == context.m_table.end()) {
-            return ExpressionResult(); // Return empty if no value found
-        }
-
-        // Handle different types of cell values
-        const auto& cellValue = it->second;
-        if (std::holds_alternative<double>(cellValue)) {
-            return std::get<double>(cellValue);
-        } else if (std::holds_alternative<std::string>(cellValue)) {
-            return std::get<std::string>(cellValue);
-        } else if (std::holds_alternative<std::shared_ptr<ExprNode>>(cellValue)) {
-            // If the cell contains an expression, evaluate it recursively
-            const std::shared_ptr<ExprNode> expr = std::get<std::shared_ptr<ExprNode>>(cellValue);
-            return expr->evaluate(context, pos.first, pos.second);
-        } else {
-            return ExpressionResult(); // Return empty for unsupported or uninitialized types
-        }
+    return ExpressionResult();
+}
 
+// Text of an operand, nullopt for numbers and undefined.
+inline std::optional<std::string_view> operandText(const Operand& val) {
+    if (const std::string* str = std::get_if<std::string>(&val)) {
+        return *str;
     }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<ValReferenceNode>(*this);
+    if (const std::string_view* view = std::get_if<std::string_view>(&val)) {
+        return *view;
     }
+    return std::nullopt;
+}
 
+enum class OpCode : unsigned char {
+    PushNumber, PushString, PushRef,
+    Add, Sub, Mul, Div, Pow, Neg,
+    Eq, Ne, Lt, Le, Gt, Ge,
+    Sum, Count, Min, Max, CountVal, If
 };
 
-class BinaryOpNode : public ExprNode {
-protected:
-    std::shared_ptr<ExprNode> left, right;
-public:
-    BinaryOpNode(std::shared_ptr<ExprNode> l, std::shared_ptr<ExprNode> r)
-            : left(std::move(l)), right(std::move(r)) {}
-    virtual ~BinaryOpNode() = default;
+struct RefOperand {
+    int posH;
+    int posW;
 };
 
-class PowNode : public BinaryOpNode {
-public:
-    using BinaryOpNode::BinaryOpNode;
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        auto lval = left->evaluate(context, row, col);
-        auto rval = right->evaluate(context, row, col);
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::pow(std::get<double>(lval), std::get<double>(rval));
+// Rectangle given by two corner references, each of them relative or absolute on its own.
+struct RangeOperand {
+    bool hAbs[2];
+    bool wAbs[2];
+    RefOperand corner[2];
+
+    // Returns top, left, bottom and right of the range placed at (row, col).
+    std::array<int, 4> bounds(int row, int col) const {
+        int r[2], c[2];
+        for (int i = 0; i < 2; ++i) {
+            r[i] = hAbs[i] ? corner[i].posH : row + corner[i].posH;
+            c[i] = wAbs[i] ? corner[i].posW : col + corner[i].posW;
         }
-        return ExpressionResult(); // Undefined if operands are not both doubles
-    }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<PowNode>(left->clone(), right->clone());
+        return {std::min(r[0], r[1]), std::min(c[0], c[1]), std::max(r[0], r[1]), std::max(c[0], c[1])};
     }
 };
 
-class MulNode : public BinaryOpNode {
-public:
-    using BinaryOpNode::BinaryOpNode;
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        auto lval = left->evaluate(context, row, col);
-        auto rval = right->evaluate(context, row, col);
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) * std::get<double>(rval);
-        }
-        return ExpressionResult(); // Undefined if operands are not both doubles
+// Number of stack slots an instruction consumes, each of them pushes one result.
+int operandCount(OpCode op) {
+    switch (op) {
+        case OpCode::PushNumber:
+        case OpCode::PushString:
+        case OpCode::PushRef:
+        case OpCode::Sum:
+        case OpCode::Count:
+        case OpCode::Min:
+        case OpCode::Max:
+            return 0;
+        case OpCode::Neg:
+        case OpCode::CountVal:
+            return 1; // Replace their operand with the result
+        case OpCode::If:
+            return 3;
+        default:
+            return 2;
     }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<MulNode>(left->clone(), right->clone());
-    }
-};
+}
 
-class DivNode : public BinaryOpNode {
-public:
-    using BinaryOpNode::BinaryOpNode;
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        auto lval = left->evaluate(context, row, col);
-        auto rval = right->evaluate(context, row, col);
-        if (std::holds_alternative<double>(rval) && std::get<double>(rval) == 0) {
-            return ExpressionResult(); // Division by zero yields undefined result
-        }
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) / std::get<double>(rval);
-        }
-        return ExpressionResult(); // Undefined if operands are not both doubles
-    }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<DivNode>(left->clone(), right->clone());
+// One step of a compiled formula, operands are stored inline.
+struct Instruction {
+    OpCode op;
+    bool hAbs = false;
+    bool wAbs = false;
+    union {
+        double number;
+        unsigned stringIndex;
+        unsigned rangeIndex;
+        RefOperand ref;
+    };
+
+    std::pair<int, int> position(int row, int col) const {
+        return {hAbs ? ref.posH : row + ref.posH, wAbs ? ref.posW : col + ref.posW};
     }
 };
 
-class SubNode : public BinaryOpNode {
-public:
-    using BinaryOpNode::BinaryOpNode;
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        auto lval = left->evaluate(context, row, col);
-        auto rval = right->evaluate(context, row, col);
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) - std::get<double>(rval);
-        }
-        return ExpressionResult(); // Undefined if operands are not both doubles
-    }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<SubNode>(left->clone(), right->clone());
-    }
+// Formula compiled into a postfix instruction array, evaluated by a stack machine.
+// References are stored relative to the owning cell unless absolute, so the same program
+// stays valid when placed at a different position.
+// Operand columns of ExprProgram::evaluateColumn, one per stack slot, kept allocated between blocks.
+struct ColumnLanes {
+    std::vector<double> values;
+    // Whether a value is defined, numbers divided by zero are not
+    std::vector<unsigned char> valid;
+    // Rows left to the scalar evaluator because an operand is not a number
+    std::vector<unsigned char> scalar;
 };
 
-
-class AddNode : public ExprNode {
-    std::shared_ptr<ExprNode> left, right;
+class ExprProgram {
 public:
-    AddNode(std::shared_ptr<ExprNode> l, std::shared_ptr<ExprNode> r)
-            : left(std::move(l)), right(std::move(r)) {}
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        auto lval = left->evaluate(context, row, col);
-        auto rval = right->evaluate(context, row, col);
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) + std::get<double>(rval);
-        } else {
-            std::string strRval;
-            std::string strLval;
-            if (std::holds_alternative<double>(lval)) {
-                strLval = std::to_string(std::get<double>(lval));
-            }
-            if (std::holds_alternative<double>(rval)) {
-                strRval = std::to_string(std::get<double>(rval));
+    // Buffer of the sheet all parts below are allocated from, declared first so it is released last.
+    std::shared_ptr<std::pmr::memory_resource> arena;
+    // Source text as written for the cell at originRow, originCol. Cells the program was copied to
+    // or shared with keep it unchanged, it is only written out by save.
+    std::pmr::string strExpr;
+    int originRow = 0;
+    int originCol = 0;
+    std::pmr::vector<Instruction> code;
+    std::pmr::vector<std::pmr::string> strings;
+    std::pmr::vector<RangeOperand> ranges;
+    size_t maxDepth = 0;
+
+    explicit ExprProgram(std::shared_ptr<std::pmr::memory_resource> arena)
+            : arena(std::move(arena)), strExpr(this->arena.get()), code(this->arena.get()),
+              strings(this->arena.get()), ranges(this->arena.get()) {}
+    // Copies the program into another buffer.
+    ExprProgram(const ExprProgram& other, std::shared_ptr<std::pmr::memory_resource> arena)
+            : arena(std::move(arena)), strExpr(other.strExpr, this->arena.get()), originRow(other.originRow), originCol(other.originCol),
+              code(other.code, this->arena.get()), strings(other.strings, this->arena.get()), ranges(other.ranges, this->arena.get()),
+              maxDepth(other.maxDepth) {}
+    ExprProgram(const ExprProgram&) = delete;
+    ExprProgram& operator=(const ExprProgram&) = delete;
+
+    // Recomputes maxDepth and checks that the code is a single well formed expression
+    // whose operands index existing strings and ranges.
+    bool validate() {
+        size_t depth = 0;
+        maxDepth = 0;
+        for (const Instruction& ins : code) {
+            if (ins.op > OpCode::If || depth < static_cast<size_t>(operandCount(ins.op))) {
+                return false;
             }
-            if (std::holds_alternative<std::string>(lval) && std::holds_alternative<std::string>(rval)) {
-                return std::get<std::string>(lval) + std::get<std::string>(rval);
-            } else if (std::holds_alternative<std::string>(lval) && std::holds_alternative<double>(rval)) {
-                return std::get<std::string>(lval) + strRval;
+            if ((ins.op == OpCode::PushString && ins.stringIndex >= strings.size())
+                || (ins.op >= OpCode::Sum && ins.op <= OpCode::CountVal && ins.rangeIndex >= ranges.size())) {
+                return false;
             }
-            else if (std::holds_alternative<double>(lval) && std::holds_alternative<std::string>(rval)) {
-                return strLval + std::get<std::string>(rval);
-            } else {
-                return ExpressionResult();
+            depth = depth - operandCount(ins.op) + 1;
+            maxDepth = std::max(maxDepth, depth);
+        }
+        return depth == 1;
+    }
+
+    // Context is the sheet the program lives in, it provides cellResult, aggregateRange and m_valueStack.
+    template<typename Context>
+    ExpressionResult evaluate(const Context& context, int row, int col) const;
+    // Same as above on a caller owned operand stack, so several threads can evaluate at once.
+    template<typename Context>
+    ExpressionResult evaluate(const Context& context, int row, int col, std::vector<Operand>& stack) const;
+    // Whether evaluateColumn can run the program: it computes with numbers only, without texts or ranges.
+    bool columnar() const {
+        for (const Instruction& ins : code) {
+            if (ins.op == OpCode::PushString || (ins.op >= OpCode::Sum && ins.op <= OpCode::CountVal)) {
+                return false;
             }
         }
-    }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<AddNode>(left->clone(), right->clone());
-    }
-};
-
-
-class NegNode : public ExprNode {
-private:
-    std::shared_ptr<ExprNode> operand;
-
-public:
-    NegNode(std::shared_ptr<ExprNode> op)
-            : operand(std::move(op)) {}
-
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        auto val = operand->evaluate(context, row, col);
-        if (std::holds_alternative<double>(val)) {
-            return -std::get<double>(val);
+        return true;
+    }
+    // Evaluates the program placed at count cells down column col from row, passing each result to
+    // store(k, result). Same results as evaluate, rows whose operands are not all numbers go through it.
+    // Context also provides columnValues.
+    template<typename Context, typename Store>
+    void evaluateColumn(const Context& context, int row, int col, int count, ColumnLanes& lanes,
+                        std::vector<Operand>& stack, Store store) const;
+    std::shared_ptr<ExprProgram> clone(std::shared_ptr<std::pmr::memory_resource> target) const {
+        return std::make_shared<ExprProgram>(*this, std::move(target));
+    }
+    // Appends absolute positions of the cells this expression refers to when placed at (row, col),
+    // and the bounds of the ranges it refers to, which are kept whole.
+    void collectReferences(int row, int col, std::vector<std::pair<int, int>>& refs,
+                           std::vector<std::array<int, 4>>& rangeRefs) const {
+        for (const Instruction& ins : code) {
+            if (ins.op == OpCode::PushRef) {
+                refs.push_back(ins.position(row, col));
+            } else if (ins.op >= OpCode::Sum && ins.op <= OpCode::CountVal) {
+                rangeRefs.push_back(ranges[ins.rangeIndex].bounds(row, col));
+            }
         }
-        return {}; // Undefined if operand is not a double
-    }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<NegNode>(operand->clone());
-    }
-};
-
-
-class RelationalOpNode : public ExprNode {
-public:
-    std::shared_ptr<ExprNode> left, right;
-    const CSpreadsheet& context; int row; int col;
-public:
-    RelationalOpNode(std::shared_ptr<ExprNode> l, std::shared_ptr<ExprNode> r, const CSpreadsheet& context, int row, int col)
-            : left(std::move(l)), right(std::move(r)), context(context), row(row), col(col) {}
-    template<typename Compare>
-    ExpressionResult compareOperands(const std::shared_ptr<ExprNode>& left, const std::shared_ptr<ExprNode>& right, const CSpreadsheet& context, int row, int col, Compare comp) const;
-    virtual ~RelationalOpNode() = default;
-};
-
-class EqNode : public RelationalOpNode {
-public:
-    using RelationalOpNode::RelationalOpNode;
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        return compareOperands(left, right, context, row, col, [](auto a, auto b) { return a == b; });
-    }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<EqNode>(left->clone(), right->clone(), context, row, col);
-    }
-};
-
-class NeNode : public RelationalOpNode {
-public:
-    using RelationalOpNode::RelationalOpNode;
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        return compareOperands(left, right, context, row, col, [](auto a, auto b) { return a != b; });
-    }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<EqNode>(left->clone(), right->clone(), context, row, col);
-    }
-};
-
-class LtNode : public RelationalOpNode {
-public:
-    using RelationalOpNode::RelationalOpNode;
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        return compareOperands(left, right, context, row, col, [](auto a, auto b) { return a < b; });
-    }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<EqNode>(left->clone(), right->clone(), context, row, col);
-    }
-};
-
-class LeNode : public RelationalOpNode {
-public:
-    using RelationalOpNode::RelationalOpNode;
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        return compareOperands(left, right, context, row, col, [](auto a, auto b) { return a <= b; });
-    }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<EqNode>(left->clone(), right->clone(), context, row, col);
-    }
-};
-
-class GtNode : public RelationalOpNode {
-public:
-    using RelationalOpNode::RelationalOpNode;
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        return compareOperands(left, right, context, row, col, [](auto a, auto b) { return a > b; });
-    }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<EqNode>(left->clone(), right->clone(), context, row, col);
-    }
-};
-
-class GeNode : public RelationalOpNode {
-public:
-    using RelationalOpNode::RelationalOpNode;
-    ExpressionResult evaluate(const CSpreadsheet& context, int row, int col) const override {
-        return compareOperands(left, right, context, row, col, [](auto a, auto b) { return a >= b; });
-    }
-    std::shared_ptr<ExprNode> clone() const override {
-        return std::make_shared<EqNode>(left->clone(), right->clone(), context, row, col);
     }
 };
 
 // Helper function to perform comparison and handle type checking
 template<typename Compare>
-ExpressionResult RelationalOpNode::compareOperands(const std::shared_ptr<ExprNode>& left, const std::shared_ptr<ExprNode>& right, const CSpreadsheet& context, int row, int col, Compare comp) const {
-    auto lval = left->evaluate(context, row, col);
-    auto rval = right->evaluate(context, row, col);
-
+Operand compareOperands(const Operand& lval, const Operand& rval, Compare comp) {
     if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
         return comp(std::get<double>(lval), std::get<double>(rval)) ? 1.0 : 0.0;
     }
-    if (std::holds_alternative<std::string>(lval) && std::holds_alternative<std::string>(rval)) {
-        return comp(std::get<std::string>(lval), std::get<std::string>(rval)) ? 1.0 : 0.0;
+    std::optional<std::string_view> ltext = operandText(lval);
+    std::optional<std::string_view> rtext = operandText(rval);
+    if (ltext && rtext) {
+        return comp(*ltext, *rtext) ? 1.0 : 0.0;
     }
     return {}; // Return undefined if types do not match or operands are not comparable
 }
 
+// Longest number std::to_string prints: all digits of the largest double, the sign, the point and 6 decimals.
+constexpr size_t NUMBER_TEXT_SIZE = DBL_MAX_10_EXP + 10;
 
+// Characters val adds to a concatenation, a number is printed into buffer the way std::to_string prints it.
+inline std::string_view concatenated(const Operand& val, char (&buffer)[NUMBER_TEXT_SIZE]) {
+    if (const double* num = std::get_if<double>(&val)) {
+        char* end = std::to_chars(buffer, buffer + NUMBER_TEXT_SIZE, *num, std::chars_format::fixed, 6).ptr;
+        return {buffer, static_cast<size_t>(end - buffer)};
+    }
+    return *operandText(val);
+}
 
-class ASTBuilder : public CExprBuilder {
-    int posH;
-    int posW;
-    const CSpreadsheet& context;
+Operand addOperands(Operand& lval, Operand& rval) {
+    const double* lnum = std::get_if<double>(&lval);
+    const double* rnum = std::get_if<double>(&rval);
+    if (lnum && rnum) {
+        return *lnum + *rnum;
+    }
+    if (std::holds_alternative<std::monostate>(lval) || std::holds_alternative<std::monostate>(rval)) {
+        return Operand();
+    }
+    // Concatenation appends to the buffer of an operand owning one, so a chain of them
+    // builds its result in one string instead of copying it at every step.
+    char lbuffer[NUMBER_TEXT_SIZE];
+    char rbuffer[NUMBER_TEXT_SIZE];
+    if (std::string* lstr = std::get_if<std::string>(&lval)) {
+        lstr->append(concatenated(rval, rbuffer));
+        return std::move(*lstr);
+    }
+    if (std::string* rstr = std::get_if<std::string>(&rval)) {
+        rstr->insert(0, concatenated(lval, lbuffer));
+        return std::move(*rstr);
+    }
+    std::string_view ltext = concatenated(lval, lbuffer);
+    std::string_view rtext = concatenated(rval, rbuffer);
+    std::string result;
+    result.reserve(ltext.size() + rtext.size());
+    result.append(ltext).append(rtext);
+    return result;
+}
 
-public:
-    ASTBuilder(int r, int c, const CSpreadsheet& context) : posH(r), posW(c), context(context){}
-    std::stack<std::shared_ptr<ExprNode>> stack;
+// Operators whose result depends on nothing but their operands, so they can also be folded at compile time.
+bool isPureOperator(OpCode op) {
+    return (op >= OpCode::Add && op <= OpCode::Ge) || op == OpCode::If;
+}
 
-    void opAdd() override {
-        auto right = std::move(stack.top()); stack.pop();
-        auto left = std::move(stack.top()); stack.pop();
-        stack.push(std::make_shared<AddNode>(std::move(left), std::move(right)));
+// Replaces the operands of a pure operator on top of the stack with its result, returns the new top.
+inline size_t applyOperator(OpCode op, Operand* stack, size_t top) {
+    switch (op) {
+        case OpCode::Neg: {
+            Operand& val = stack[top - 1];
+            if (double* num = std::get_if<double>(&val)) {
+                *num = -*num;
+            } else {
+                val = Operand(); // Undefined if operand is not a double
+            }
+            return top;
+        }
+        case OpCode::If: {
+            // Both branches are already evaluated, pick one by the condition
+            const double* cond = std::get_if<double>(&stack[top - 3]);
+            if (!cond) {
+                stack[top - 3] = Operand();
+            } else {
+                stack[top - 3] = std::move(stack[*cond != 0 ? top - 2 : top - 1]);
+            }
+            return top - 2;
+        }
+        case OpCode::Add:
+            stack[top - 2] = addOperands(stack[top - 2], stack[top - 1]);
+            return top - 1;
+        case OpCode::Eq:
+            stack[top - 2] = compareOperands(stack[top - 2], stack[top - 1], [](const auto& a, const auto& b) { return a == b; });
+            return top - 1;
+        case OpCode::Ne:
+            stack[top - 2] = compareOperands(stack[top - 2], stack[top - 1], [](const auto& a, const auto& b) { return a != b; });
+            return top - 1;
+        case OpCode::Lt:
+            stack[top - 2] = compareOperands(stack[top - 2], stack[top - 1], [](const auto& a, const auto& b) { return a < b; });
+            return top - 1;
+        case OpCode::Le:
+            stack[top - 2] = compareOperands(stack[top - 2], stack[top - 1], [](const auto& a, const auto& b) { return a <= b; });
+            return top - 1;
+        case OpCode::Gt:
+            stack[top - 2] = compareOperands(stack[top - 2], stack[top - 1], [](const auto& a, const auto& b) { return a > b; });
+            return top - 1;
+        case OpCode::Ge:
+            stack[top - 2] = compareOperands(stack[top - 2], stack[top - 1], [](const auto& a, const auto& b) { return a >= b; });
+            return top - 1;
+        default: {
+            // Arithmetic on two doubles, undefined for any other operands
+            Operand& lval = stack[top - 2];
+            const double* lnum = std::get_if<double>(&lval);
+            const double* rnum = std::get_if<double>(&stack[top - 1]);
+            if (!lnum || !rnum) {
+                lval = Operand();
+                return top - 1;
+            }
+            switch (op) {
+                case OpCode::Sub: lval = *lnum - *rnum; break;
+                case OpCode::Mul: lval = *lnum * *rnum; break;
+                case OpCode::Pow: lval = std::pow(*lnum, *rnum); break;
+                case OpCode::Div:
+                    // Division by zero yields undefined result
+                    lval = *rnum == 0 ? Operand() : Operand(*lnum / *rnum);
+                    break;
+                default: lval = Operand(); break;
+            }
+            return top - 1;
+        }
     }
+}
 
-    void opPow() override {
-        auto right = std::move(stack.top()); stack.pop();
-        auto left = std::move(stack.top()); stack.pop();
-        stack.push(std::make_shared<PowNode>(std::move(left), std::move(right)));
-    }
+template<typename Context>
+ExpressionResult ExprProgram::evaluate(const Context& context, int row, int col) const {
+    return evaluate(context, row, col, context.m_valueStack);
+}
 
-    void opMul() override {
-        auto right = std::move(stack.top()); stack.pop();
-        auto left = std::move(stack.top()); stack.pop();
-        stack.push(std::make_shared<MulNode>(std::move(left), std::move(right)));
+template<typename Context>
+ExpressionResult ExprProgram::evaluate(const Context& context, int row, int col, std::vector<Operand>& stack) const {
+    // The value stack is shared by nested evaluations of referenced cells, each one works above
+    // the slots of its caller. Slots are addressed by index as nested calls may grow the vector.
+    size_t base = stack.size();
+    stack.resize(base + maxDepth);
+    size_t top = base;
+
+    for (const Instruction& ins : code) {
+        switch (ins.op) {
+            case OpCode::PushNumber:
+                stack[top++] = ins.number;
+                break;
+            case OpCode::PushString:
+                stack[top++] = std::string_view(strings[ins.stringIndex]);
+                break;
+            case OpCode::PushRef: {
+                Operand val = context.cellOperand(ins.position(row, col));
+                stack[top++] = std::move(val);
+                break;
+            }
+            case OpCode::Sum:
+            case OpCode::Count:
+            case OpCode::Min:
+            case OpCode::Max: {
+                auto [firstRow, firstCol, lastRow, lastCol] = ranges[ins.rangeIndex].bounds(row, col);
+                ExpressionResult val = context.aggregateRange(ins.op, firstRow, firstCol, lastRow, lastCol, ExpressionResult());
+                stack[top++] = toOperand(std::move(val));
+                break;
+            }
+            case OpCode::CountVal: {
+                auto [firstRow, firstCol, lastRow, lastCol] = ranges[ins.rangeIndex].bounds(row, col);
+                ExpressionResult needle = toResult(std::move(stack[top - 1]));
+                stack[top - 1] = toOperand(context.aggregateRange(ins.op, firstRow, firstCol, lastRow, lastCol, needle));
+                break;
+            }
+            default:
+                top = applyOperator(ins.op, stack.data(), top);
+                break;
+        }
     }
 
-    void opDiv() override {
-        auto right = std::move(stack.top()); stack.pop();
-        auto left = std::move(stack.top()); stack.pop();
-        stack.push(std::make_shared<DivNode>(std::move(left), std::move(right)));
-    }
+    ExpressionResult result = top > base ? toResult(std::move(stack[base])) : ExpressionResult();
+    stack.resize(base);
+    return result;
+}
+
 
-    void opSub() override {
-        auto right = std::move(stack.top()); stack.pop();
-        auto left = std::move(stack.top()); stack.pop();
-        stack.push(std::make_shared<SubNode>(std::move(left), std::move(right)));
+
+template<typename Context, typename Store>
+void ExprProgram::evaluateColumn(const Context& context, int row, int col, int count, ColumnLanes& lanes,
+                                 std::vector<Operand>& stack, Store store) const {
+    size_t n = count;
+    lanes.values.resize(maxDepth * n);
+    lanes.valid.resize(maxDepth * n);
+    lanes.scalar.assign(n, 0);
+    unsigned char* scalar = lanes.scalar.data();
+    size_t top = 0;
+    // Stack slot i of all rows is a column of n lanes
+    auto values = [&](size_t slot) { return lanes.values.data() + slot * n; };
+    auto valid = [&](size_t slot) { return lanes.valid.data() + slot * n; };
+
+    for (const Instruction& ins : code) {
+        if (ins.op == OpCode::PushNumber) {
+            std::fill_n(values(top), n, ins.number);
+            std::fill_n(valid(top), n, 1);
+            top++;
+            continue;
+        }
+        if (ins.op == OpCode::PushRef) {
+            double* v = values(top);
+            unsigned char* ok = valid(top);
+            auto [refRow, refCol] = ins.position(row, col);
+            if (ins.hAbs) {
+                // Every row reads the same cell
+                ExpressionResult val = context.cellResult({refRow, refCol});
+                const double* num = std::get_if<double>(&val);
+                std::fill_n(v, n, num ? *num : 0);
+                std::fill_n(ok, n, num != nullptr);
+            } else {
+                context.columnValues(refRow, refCol, count, v, ok);
+            }
+            for (size_t k = 0; k < n; ++k) {
+                scalar[k] |= !ok[k];
+            }
+            top++;
+            continue;
+        }
+        if (ins.op == OpCode::Neg) {
+            double* a = values(top - 1);
+            for (size_t k = 0; k < n; ++k) {
+                a[k] = -a[k];
+            }
+            continue;
+        }
+        if (ins.op == OpCode::If) {
+            const double* c = values(top - 3);
+            const unsigned char* vc = valid(top - 3);
+            double* a = values(top - 2);
+            unsigned char* va = valid(top - 2);
+            const double* b = values(top - 1);
+            const unsigned char* vb = valid(top - 1);
+            double* out = values(top - 3);
+            unsigned char* vout = valid(top - 3);
+            for (size_t k = 0; k < n; ++k) {
+                bool first = c[k] != 0;
+                vout[k] = vc[k] & (first ? va[k] : vb[k]);
+                out[k] = first ? a[k] : b[k];
+            }
+            top -= 2;
+            continue;
+        }
+        // Binary operators, the result replaces the left operand
+        double* a = values(top - 2);
+        unsigned char* va = valid(top - 2);
+        const double* b = values(top - 1);
+        const unsigned char* vb = valid(top - 1);
+        for (size_t k = 0; k < n; ++k) {
+            va[k] &= vb[k];
+        }
+        switch (ins.op) {
+            case OpCode::Add: for (size_t k = 0; k < n; ++k) a[k] = a[k] + b[k]; break;
+            case OpCode::Sub: for (size_t k = 0; k < n; ++k) a[k] = a[k] - b[k]; break;
+            case OpCode::Mul: for (size_t k = 0; k < n; ++k) a[k] = a[k] * b[k]; break;
+            case OpCode::Pow: for (size_t k = 0; k < n; ++k) a[k] = std::pow(a[k], b[k]); break;
+            case OpCode::Div:
+                // Division by zero yields undefined result
+                for (size_t k = 0; k < n; ++k) {
+                    va[k] &= b[k] != 0;
+                    a[k] = a[k] / b[k];
+                }
+                break;
+            case OpCode::Eq: for (size_t k = 0; k < n; ++k) a[k] = a[k] == b[k] ? 1.0 : 0.0; break;
+            case OpCode::Ne: for (size_t k = 0; k < n; ++k) a[k] = a[k] != b[k] ? 1.0 : 0.0; break;
+            case OpCode::Lt: for (size_t k = 0; k < n; ++k) a[k] = a[k] < b[k] ? 1.0 : 0.0; break;
+            case OpCode::Le: for (size_t k = 0; k < n; ++k) a[k] = a[k] <= b[k] ? 1.0 : 0.0; break;
+            case OpCode::Gt: for (size_t k = 0; k < n; ++k) a[k] = a[k] > b[k] ? 1.0 : 0.0; break;
+            case OpCode::Ge: for (size_t k = 0; k < n; ++k) a[k] = a[k] >= b[k] ? 1.0 : 0.0; break;
+            default: std::fill_n(va, n, 0); break;
+        }
+        top--;
     }
 
-    void opNeg() override {
-        auto operand = std::move(stack.top()); stack.pop();
-        stack.push(std::make_shared<NegNode>(std::move(operand)));
+    const double* result = values(0);
+    const unsigned char* defined = valid(0);
+    for (size_t k = 0; k < n; ++k) {
+        if (scalar[k]) {
+            store(k, evaluate(context, row + static_cast<int>(k), col, stack));
+        } else {
+            store(k, defined[k] ? ExpressionResult(result[k]) : ExpressionResult());
+        }
     }
+}
 
 
-    void opEq() override {
-        auto right = std::move(stack.top()); stack.pop();
-        auto left = std::move(stack.top()); stack.pop();
-        stack.push(std::make_shared<EqNode>(std::move(left), std::move(right), context, posH, posW));
+class ASTBuilder : public CExprBuilder {
+    int posH;
+    int posW;
+    std::shared_ptr<ExprProgram> program;
+    size_t depth = 0;
+    // Ranges parsed but not yet consumed by their function call
+    std::vector<unsigned> pendingRanges;
+
+    void emit(const Instruction& ins) {
+        depth = depth - operandCount(ins.op) + 1;
+        program->maxDepth = std::max(program->maxDepth, depth);
+        if (!simplify(ins.op)) {
+            program->code.push_back(ins);
+        }
     }
 
-    void opNe() override {
-        auto right = std::move(stack.top()); stack.pop();
-        auto left = std::move(stack.top()); stack.pop();
-        stack.push(std::make_shared<NeNode>(std::move(left), std::move(right), context, posH, posW));
+    // Whether an instruction always leaves a number or undefined, never a text.
+    static bool numericResult(OpCode op) {
+        return op == OpCode::PushNumber || (op >= OpCode::Sub && op <= OpCode::CountVal);
     }
 
-    void opLt() override {
-        auto right = std::move(stack.top()); stack.pop();
-        auto left = std::move(stack.top()); stack.pop();
-        stack.push(std::make_shared<LtNode>(std::move(left), std::move(right), context, posH, posW));
+    // Rewrites the code emitted so far to already include op, returns false if op still has to be emitted.
+    // A pure operator over constants becomes a single push of its result and a double negation of
+    // a number cancels out. The source text stays as written, only the instructions change.
+    bool simplify(OpCode op) {
+        auto& code = program->code;
+        if (op == OpCode::Neg && code.size() >= 2 && code.back().op == OpCode::Neg
+            && numericResult(code[code.size() - 2].op)) {
+            code.pop_back();
+            return true;
+        }
+        // Postfix code ending in count pushes ends with exactly the operands of op
+        size_t count = operandCount(op);
+        if (!isPureOperator(op) || code.size() < count) {
+            return false;
+        }
+        Operand operands[3];
+        size_t first = code.size() - count;
+        for (size_t i = 0; i < count; ++i) {
+            const Instruction& operand = code[first + i];
+            if (operand.op == OpCode::PushNumber) {
+                operands[i] = operand.number;
+            } else if (operand.op == OpCode::PushString) {
+                operands[i] = std::string_view(program->strings[operand.stringIndex]);
+            } else {
+                return false;
+            }
+        }
+        applyOperator(op, operands, count);
+        if (std::holds_alternative<std::monostate>(operands[0])) {
+            return false; // No instruction pushes undefined
+        }
+        // The result may view a literal removed below
+        ExpressionResult result = toResult(std::move(operands[0]));
+        // The strings of the operands are the last ones added
+        for (size_t i = first; i < code.size(); ++i) {
+            if (code[i].op == OpCode::PushString) {
+                program->strings.pop_back();
+            }
+        }
+        code.resize(first);
+        if (const double* num = std::get_if<double>(&result)) {
+            Instruction folded{};
+            folded.op = OpCode::PushNumber;
+            folded.number = *num;
+            code.push_back(folded);
+        } else {
+            Instruction folded{};
+            folded.op = OpCode::PushString;
+            folded.stringIndex = program->strings.size();
+            program->strings.emplace_back(std::get<std::string>(result));
+            code.push_back(folded);
+        }
+        return true;
     }
-
-    void opLe() override {
-        auto right = std::move(stack.top()); stack.pop();
-        auto left = std::move(stack.top()); stack.pop();
-        stack.push(std::make_shared<LeNode>(std::move(left), std::move(right), context, posH, posW));
+    void emit(OpCode op) {
+        Instruction ins{};
+        ins.op = op;
+        emit(ins);
     }
 
-    void opGt() override {
-        auto right = std::move(stack.top()); stack.pop();
-        auto left = std::move(stack.top()); stack.pop();
-        stack.push(std::make_shared<GtNode>(std::move(left), std::move(right), context, posH, posW));
+    // Parses a reference like $A$1 into its position, relative to the cell being built unless absolute.
+    void parseReference(std::string_view val, bool& hAbs, bool& wAbs, RefOperand& ref) const {
+        // A leading '$' fixes the column, one between the letters and digits fixes the row
+        wAbs = !val.empty() && val[0] == '$';
+        if (wAbs) {
+            val.remove_prefix(1);
+        }
+        int row;
+        int col;
+        if (!parseCellName(val, row, col, &hAbs)) {
+            throw std::invalid_argument("Invalid reference");
+        }
+        ref.posH = hAbs ? row : row - posH;
+        ref.posW = wAbs ? col : col - posW;
     }
 
-    void opGe() override {
-        auto right = std::move(stack.top()); stack.pop();
-        auto left = std::move(stack.top()); stack.pop();
-        stack.push(std::make_shared<GeNode>(std::move(left), std::move(right), context, posH, posW));
-    }
+public:
+    // The program is allocated from arena, which only this builder may use while it runs.
+    ASTBuilder(int r, int c, std::shared_ptr<std::pmr::memory_resource> arena)
+            : posH(r), posW(c), program(std::make_shared<ExprProgram>(std::move(arena))) {}
+
+    void opAdd() override { emit(OpCode::Add); }
+    void opPow() override { emit(OpCode::Pow); }
+    void opMul() override { emit(OpCode::Mul); }
+    void opDiv() override { emit(OpCode::Div); }
+    void opSub() override { emit(OpCode::Sub); }
+    void opNeg() override { emit(OpCode::Neg); }
+
+    void opEq() override { emit(OpCode::Eq); }
+    void opNe() override { emit(OpCode::Ne); }
+    void opLt() override { emit(OpCode::Lt); }
+    void opLe() override { emit(OpCode::Le); }
+    void opGt() override { emit(OpCode::Gt); }
+    void opGe() override { emit(OpCode::Ge); }
 
 
     void valNumber(double val) override {
-        stack.push(std::make_shared<NumberNode>(val));
+        Instruction ins{};
+        ins.op = OpCode::PushNumber;
+        ins.number = val;
+        emit(ins);
     }
 
     void valString(std::string val) override {
-        stack.push(std::make_shared<StringNode>(val));
+        Instruction ins{};
+        ins.op = OpCode::PushString;
+        ins.stringIndex = program->strings.size();
+        program->strings.emplace_back(val);
+        emit(ins);
     }
 
     void valReference(std::string val) override {
-        bool hAbs;
-        bool wAbs;
-        int posValH;
-        int posValW;
-
-        // Determine whether the reference is absolute or relative
-        if (val[0] == '$') {
-            wAbs = true;
-            val.erase(0, 1); // Remove '$' from the beginning
-        } else {
-            wAbs = false;
-        }
+        Instruction ins{};
+        ins.op = OpCode::PushRef;
+        parseReference(val, ins.hAbs, ins.wAbs, ins.ref);
+        emit(ins);
+    }
 
-        // Check if there's a second '$' to determine absolute or relative in the vertical direction
-        auto secondDollarPos = val.find('$', 1);
-        if (secondDollarPos != std::string::npos) {
-            hAbs = true;
-            val.erase(secondDollarPos, 1); // Remove second '$'
-        } else {
-            hAbs = false;
+    void valRange ( std::string val ) override {
+        size_t colon = val.find(':');
+        if (colon == std::string::npos) {
+            throw std::invalid_argument("Invalid range: " + val);
         }
-
-        // Parse row and column numbers
-        std::string letters;
-        int numbers;
-        splitString(val, letters, numbers);
-        if (hAbs) {
-            posValH = numbers;
-        } else {
-            posValH = numbers - posH;
+        RangeOperand range{};
+        std::string_view corners = val;
+        parseReference(corners.substr(0, colon), range.hAbs[0], range.wAbs[0], range.corner[0]);
+        parseReference(corners.substr(colon + 1), range.hAbs[1], range.wAbs[1], range.corner[1]);
+        pendingRanges.push_back(program->ranges.size());
+        program->ranges.push_back(range);
+    }
+
+    void funcCall ( std::string fnName, int paramCount ) override {
+        static const std::map<std::string, OpCode> functions = {
+                {"sum", OpCode::Sum}, {"count", OpCode::Count}, {"min", OpCode::Min},
+                {"max", OpCode::Max}, {"countval", OpCode::CountVal}, {"if", OpCode::If}
+        };
+        auto fn = functions.find(fnName);
+        if (fn == functions.end()) {
+            throw std::invalid_argument("Unknown function " + fnName);
         }
-
-        if (wAbs) {
-            posValW = letterToNumber(letters);
-        } else {
-            posValW = letterToNumber(letters) - posW;
+        // Aggregates take their range besides the operands on the stack
+        if (paramCount != operandCount(fn->second) + (fn->second != OpCode::If)) {
+            throw std::invalid_argument("Wrong number of arguments to " + fnName);
         }
-
-        stack.push(std::make_shared<ValReferenceNode>(hAbs, wAbs, posValH, posValW)); // Implement ReferenceNode accordingly
+        Instruction ins{};
+        ins.op = fn->second;
+        if (fn->second != OpCode::If) {
+            if (pendingRanges.empty()) {
+                throw std::invalid_argument("Function " + fnName + " requires a range");
+            }
+            ins.rangeIndex = pendingRanges.back();
+            pendingRanges.pop_back();
+        }
+        emit(ins);
     }
 
-    void valRange ( std::string val ) override {}
-    void funcCall ( std::string fnName, int paramCount ) override {}
-
-    std::shared_ptr<ExprNode> getExpression() {
-        return std::move(stack.top());
+    std::shared_ptr<ExprProgram> getExpression() {
+        return std::move(program);
     }
 };
 
@@ -33,6 +33,11 @@
 #include <span>
 #include <utility>
 #include "expression.h"
+#include "cellGrid.h"
+#include "cellHandle.h"
+#include "aggregateIndex.h"
+#include "rangeIndex.h"
+#include "mappedFile.h"
 
 using namespace std::literals;
 using CValue = std::variant<std::monostate, double, std::string>;
@@ -43,29 +48,46 @@ constexpr unsigned                     SPREADSHEET_FILE_IO                     =
 constexpr unsigned                     SPREADSHEET_SPEED                       = 0x08;
 constexpr unsigned                     SPREADSHEET_PARSER                      = 0x10;
 #endif /* __PROGTEST__ */
+#include <atomic>
+#include <barrier>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory_resource>
+#include <mutex>
+#include <thread>
 
-int globalCount = 0;
 
-
-bool checkCPos(std::string_view & str) {
+// Parses contents the way std::stod accepts a whole string: leading whitespace, an optional sign, decimal
+// or 0x hexadecimal digits with an optional exponent, inf or nan. Anything else, including values out of
+// range, is not a number. Unlike std::stod nothing is thrown, so text costs no more than a number.
+std::optional<double> parseNumber(std::string_view str) {
     size_t i = 0;
-    while (i < static_cast<size_t>(str.size()) && std::isalpha(str[i])) {
+    while (i < str.size() && std::isspace(static_cast<unsigned char>(str[i]))) {
         i++;
     }
-    if (i == 0 || i == str.size()) { // No letters or no numbers
-        return false;
+    bool negative = i < str.size() && str[i] == '-';
+    if (i < str.size() && (str[i] == '-' || str[i] == '+')) {
+        i++;
     }
-    size_t j = i;
-    while (j < static_cast<size_t>(str.size()) && std::isdigit(str[j])) {
-        j++;
+    std::string_view digits = str.substr(i);
+    auto format = std::chars_format::general;
+    if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) {
+        digits.remove_prefix(2);
+        format = std::chars_format::hex;
     }
-    if (j != static_cast<size_t>(str.size())) { // Characters after numbers or no digits at all
-        return false;
+    // from_chars takes a minus sign of its own, the sign was already consumed
+    if (digits.empty() || digits[0] == '-' || digits[0] == '+') {
+        return std::nullopt;
     }
-    return true;
+    double val;
+    auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), val, format);
+    if (error != std::errc() || end != digits.data() + digits.size()) {
+        return std::nullopt;
+    }
+    return negative ? -val : val;
 }
 
-
 int letterToNumber(std::string_view input) {
     int result = 0;
     for (char c : input) {
@@ -77,35 +99,45 @@ int letterToNumber(std::string_view input) {
     return result - 1; // Excel's numbering starts from 0
 }
 
-void splitString(std::string_view input, std::string& letters, int& numbers) {
-    letters.clear();
-    for (char c : input) {
-        if (std::isalpha(c)) {
-            letters.push_back(c);
-        } else {
-            break;
+// Parses a cell name like AB12 in place: letters for the column, then decimal digits for the row.
+// If rowAbsolute is given, a '$' may separate the two and is reported through it. Names whose column or
+// row does not fit an int are rejected along with any other malformed input.
+bool parseCellName(std::string_view str, int& row, int& col, bool* rowAbsolute = nullptr) {
+    size_t i = 0;
+    int column = 0;
+    while (i < str.size() && std::isalpha(static_cast<unsigned char>(str[i]))) {
+        if (column > (INT_MAX - 26) / 26) {
+            return false;
         }
+        column = column * 26 + (std::toupper(static_cast<unsigned char>(str[i])) - 'A' + 1);
+        i++;
+    }
+    if (i == 0) { // No letters
+        return false;
+    }
+    if (rowAbsolute) {
+        *rowAbsolute = i < str.size() && str[i] == '$';
+        i += *rowAbsolute;
+    }
+    // from_chars would take a minus sign, the row is digits only
+    if (i == str.size() || !std::isdigit(static_cast<unsigned char>(str[i]))) {
+        return false;
+    }
+    auto [end, error] = std::from_chars(str.data() + i, str.data() + str.size(), row);
+    if (error != std::errc() || end != str.data() + str.size()) {
+        return false;
     }
-    std::string numStr = std::string(input.substr(letters.size()));
-    numbers = std::stoi(numStr);
+    col = column - 1; // Excel's numbering starts from 0
+    return true;
 }
 
 
 class CPos {
 public:
     CPos (std::string_view str) {
-        std::string letters;
-        int numbers;
-
-        if (checkCPos(str) == false) {
+        if (!parseCellName(str, cPosHW.first, cPosHW.second)) {
             throw std::invalid_argument("Invalid cell position format.");
         }
-
-        splitString(str, letters, numbers);
-
-        cPosHW.first = numbers;
-        cPosHW.second = letterToNumber(letters);
-
     }
     CPos(int h, int w) {
         cPosHW.first = h;
@@ -115,214 +147,2255 @@ public:
     std::pair<int, int> cPosHW;
 };
 
-class ExprNode;
+class ExprProgram;
+enum class OpCode : unsigned char;
+// Value on the operand stack of the formula interpreter. Texts stored elsewhere, string literals of the program,
+// text cells and cached results, are pushed as views, only concatenation results own their characters.
+using Operand = std::variant<std::monostate, double, std::string, std::string_view>;
+struct WorkbookContents;
+
+struct PosHash {
+    size_t operator()(const std::pair<int, int>& pos) const {
+        return std::hash<long long>()((static_cast<long long>(pos.first) << 32) ^ static_cast<unsigned>(pos.second));
+    }
+};
+
+struct TextKey {
+    std::string_view operator()(const std::string& text) const {
+        return text;
+    }
+};
+struct ProgramKey {
+    const ExprProgram* operator()(const std::shared_ptr<ExprProgram>& program) const {
+        return program.get();
+    }
+};
+using TextPool = InternTable<std::string, std::string_view, TextKey>;
+using ProgramTable = InternTable<std::shared_ptr<ExprProgram>, const ExprProgram*, ProgramKey>;
+
+// Bump allocated memory for the compiled formulas of one sheet. Programs keep the buffer alive,
+// so it is released as a whole once the sheet resets it and the last program using it is gone.
+class FormulaArena {
+public:
+    FormulaArena() {
+        reset();
+    }
+    // A copied sheet shares the programs of the original but allocates new ones from its own buffer
+    FormulaArena(const FormulaArena&) : FormulaArena() {}
+    FormulaArena& operator=(const FormulaArena&) {
+        reset();
+        return *this;
+    }
+
+    void reset() {
+        reset(std::make_shared<std::pmr::monotonic_buffer_resource>(), 0);
+    }
+    // Takes over a buffer already holding the given number of programs.
+    void reset(std::shared_ptr<std::pmr::memory_resource> resource, size_t programCount) {
+        m_resource = std::move(resource);
+        programs = programCount;
+        compactAt = std::max(MIN_COMPACT, 2 * programCount);
+    }
+    const std::shared_ptr<std::pmr::memory_resource>& resource() const {
+        return m_resource;
+    }
+
+    // Programs allocated from the current buffer, including the ones already replaced
+    size_t programs = 0;
+    // Count at which the live programs are moved into a fresh buffer if most of it is garbage
+    size_t compactAt = MIN_COMPACT;
+    static constexpr size_t MIN_COMPACT = 4096;
+
+private:
+    std::shared_ptr<std::pmr::memory_resource> m_resource;
+};
+
+// Recency order of the tiles that may be dropped from memory, least recently used last.
+class TileLru {
+public:
+    TileLru() = default;
+    TileLru(const TileLru& other) : m_order(other.m_order) {
+        reindex();
+    }
+    TileLru& operator=(const TileLru& other) {
+        m_order = other.m_order;
+        reindex();
+        return *this;
+    }
+
+    // Moves the tile to the front, adding it if needed.
+    void touch(const std::pair<int, int>& tile) {
+        auto it = m_position.find(tile);
+        if (it != m_position.end()) {
+            m_order.splice(m_order.begin(), m_order, it->second);
+        } else {
+            m_order.push_front(tile);
+            m_position.emplace(tile, m_order.begin());
+        }
+    }
+    // Touches the tile only if it is already tracked.
+    void refresh(const std::pair<int, int>& tile) {
+        auto it = m_position.find(tile);
+        if (it != m_position.end()) {
+            m_order.splice(m_order.begin(), m_order, it->second);
+        }
+    }
+    void erase(const std::pair<int, int>& tile) {
+        auto it = m_position.find(tile);
+        if (it != m_position.end()) {
+            m_order.erase(it->second);
+            m_position.erase(it);
+        }
+    }
+    std::pair<int, int> popOldest() {
+        std::pair<int, int> tile = m_order.back();
+        m_position.erase(tile);
+        m_order.pop_back();
+        return tile;
+    }
+    size_t size() const {
+        return m_order.size();
+    }
+    void clear() {
+        m_order.clear();
+        m_position.clear();
+    }
+
+private:
+    void reindex() {
+        m_position.clear();
+        for (auto it = m_order.begin(); it != m_order.end(); ++it) {
+            m_position.emplace(*it, it);
+        }
+    }
+
+    std::list<std::pair<int, int>> m_order;
+    std::unordered_map<std::pair<int, int>, std::list<std::pair<int, int>>::iterator, PosHash> m_position;
+};
+
+// Values of all cells of a sheet as of one CSpreadsheet::publish, never changed afterwards.
+// Any number of threads may read it at once, also while the sheet it came from is being changed.
+class CSheetVersion {
+public:
+    CSheetVersion(CellGrid<CValue> values, uint64_t number) : m_values(std::move(values)), m_number(number) {}
+
+    CValue getValue(CPos pos) const {
+        const CValue* value = m_values.find(pos.cPosHW);
+        return value ? *value : CValue();
+    }
+    // Versions of one sheet are numbered from 1 in the order they were published.
+    uint64_t number() const {
+        return m_number;
+    }
+
+private:
+    CellGrid<CValue> m_values;
+    uint64_t m_number;
+};
+
+// Latest version of a sheet. Publishing swaps the pointer atomically, so readers never wait for the writer
+// and keep the version they pinned however many are published after it.
+class PublishedVersion {
+public:
+    PublishedVersion() = default;
+    PublishedVersion(const PublishedVersion& other) : m_latest(other.m_latest.load()) {}
+    PublishedVersion& operator=(const PublishedVersion& other) {
+        m_latest.store(other.m_latest.load());
+        return *this;
+    }
+
+    std::shared_ptr<const CSheetVersion> load() const {
+        return m_latest.load();
+    }
+    void store(std::shared_ptr<const CSheetVersion> version) {
+        m_latest.store(std::move(version));
+    }
+
+private:
+    std::atomic<std::shared_ptr<const CSheetVersion>> m_latest;
+};
+
+// Thread evaluating the formulas of a sheet in the background, started by CSpreadsheet::getValueAsync.
+// It answers the requested cells first, then evaluates the other dirty cells. Every public method of the
+// sheet takes the lock, the worker holds it for one requested cell or one slice of dirty cells at a time.
+class BackgroundRecalc {
+public:
+    BackgroundRecalc() = default;
+    // The worker belongs to one sheet object, a copied sheet takes the lock of its source instead
+    BackgroundRecalc(const BackgroundRecalc&) = delete;
+    BackgroundRecalc& operator=(const BackgroundRecalc&) = delete;
+    ~BackgroundRecalc() {
+        stop();
+    }
+
+    std::unique_lock<std::mutex> lock() const {
+        return std::unique_lock<std::mutex>(m_mutex);
+    }
+    bool running() const {
+        return m_thread.joinable();
+    }
+    template<typename Loop>
+    void start(Loop loop) {
+        reseed = true;
+        m_thread = std::thread(std::move(loop));
+    }
+    // Lets the worker answer the requests already made and waits for it to exit. Not called with the lock held.
+    void stop() {
+        if (!running()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        m_thread.join();
+        stopping = false;
+        dirty.clear();
+    }
 
-CPos globalCycleCheck = CPos("A1");
+    struct Request {
+        std::pair<int, int> pos;
+        std::promise<CValue> promise;
+    };
+    // All below are guarded by the lock
+    std::deque<Request> requests;
+    // Cells invalidated while the worker runs, in the order they became dirty
+    std::deque<std::pair<int, int>> dirty;
+    // Set when the dirty cells are not known one by one, at the start and after a load
+    bool reseed = false;
+    bool stopping = false;
+    std::condition_variable wake;
+
+private:
+    mutable std::mutex m_mutex;
+    std::thread m_thread;
+};
+
+// Callbacks on changes of cell values, see CSpreadsheet::subscribe. They belong to one sheet object,
+// a copy or a sheet assigned to starts without any.
+class CellSubscriptions {
+public:
+    using Callback = std::function<void(const std::vector<std::pair<CPos, CValue>>&)>;
+    struct Subscription {
+        int row;
+        int col;
+        int h;
+        int w;
+        Callback callback;
+    };
+    // Subscriptions covering a cell and the value they were last told about
+    struct Watch {
+        unsigned count = 0;
+        CValue value;
+    };
+
+    CellSubscriptions() = default;
+    CellSubscriptions(const CellSubscriptions&) {}
+    CellSubscriptions& operator=(const CellSubscriptions&) {
+        subscriptions.clear();
+        watches.clear();
+        pending.clear();
+        all = false;
+        return *this;
+    }
+
+    std::map<size_t, Subscription> subscriptions;
+    size_t nextId = 1;
+    CellGrid<Watch> watches;
+    // Watched cells invalidated by the edit in progress
+    std::vector<std::pair<int, int>> pending;
+    // Set when the edit may have changed any cell, like a load does
+    bool all = false;
+};
 
 class CSpreadsheet {
 public:
     static unsigned capabilities () {
-        return SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_FILE_IO | SPREADSHEET_SPEED;
+        return SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_FUNCTIONS | SPREADSHEET_FILE_IO | SPREADSHEET_SPEED;
     }
     CSpreadsheet () = default;
+    // The source is copied under its lock while its worker goes on running, the copy starts without one.
+    CSpreadsheet(const CSpreadsheet& other);
+    CSpreadsheet& operator=(const CSpreadsheet& other);
+    ~CSpreadsheet() {
+        m_background.stop();
+    }
     bool load (std::istream & is);
     bool save ( std::ostream & os ) const;
+    // Writes the smaller encoding that load reads too, but open and CSnapshot cannot map.
+    bool saveCompact(std::ostream& os) const;
     bool setCell (CPos pos, std::string contents);
     CValue getValue (CPos pos);
+    // Calls callback after each edit that changes the value of some cells of the w x h rectangle at pos, once
+    // with all of them and their new values as getValue returns them. An edit is one call of setCell, setCells,
+    // copyRect, load or open. The callback runs after the sheet is unlocked, so it may read the sheet.
+    // Returns the id unsubscribe takes.
+    size_t subscribe(CPos pos, int w, int h, CellSubscriptions::Callback callback);
+    void unsubscribe(size_t id);
+    // Returns the value of the cell once the background worker has evaluated it, without waiting for it here.
+    // Requested cells are evaluated before the other dirty ones, a clean cell gets a ready future.
+    std::future<CValue> getValueAsync(CPos pos);
     void copyRect (CPos dst, CPos src, int w = 1, int h = 1);
+    // Sets many cells at once, as if by setCell in order. Formulas are parsed on up to threads threads and
+    // the dependency graph is updated once for the whole batch. If a formula cannot be parsed, returns false
+    // and changes nothing.
+    bool setCells(std::span<const std::pair<CPos, std::string>> cells, unsigned threads = std::thread::hardware_concurrency());
+    // Evaluates every formula that has no cached value yet on up to threads threads.
+    // The results are the same as those getValue would compute one by one.
+    void recalculateAll(unsigned threads = std::thread::hardware_concurrency());
+    // Opens a saved workbook in paged mode. Only the tile directory is read here, cells stay in the mapped file
+    // and a tile is read into memory on first access, at most maxTiles unmodified tiles stay loaded. A tile
+    // failing its checksum reads as empty. Modified tiles stay in memory and are written out together with
+    // the tiles still in the file by save.
+    bool open(const std::string& fileName, size_t maxTiles = 1024);
+    // Evaluates the formulas and publishes the values of all cells as the version pin returns. Only the cells
+    // changed since the previous publish are copied, the rest is shared with it. The first publish after
+    // a load or open reads the whole sheet, loading every tile of a paged one.
+    void publish(unsigned threads = std::thread::hardware_concurrency());
+    // Returns the version published last, nullptr before the first publish. Unlike the other methods
+    // it may be called from any thread while the sheet is being changed.
+    std::shared_ptr<const CSheetVersion> pin() const;
+
+
+    using cellValue = std::variant<std::monostate, double, std::string, std::shared_ptr<ExprProgram>>;
+    using posSet = std::unordered_set<std::pair<int, int>, PosHash>;
+    mutable BackgroundRecalc m_background;
+    CellSubscriptions m_subscriptions;
+    // Plain numbers are kept apart in a dense lane of doubles, m_table holds texts and formulas as handles
+    // into m_texts and m_programs. All are mutable because reading a cell of an opened workbook may load its tile.
+    mutable CellGrid<double> m_numbers;
+    mutable CellGrid<CellHandle> m_table;
+    mutable TextPool m_texts;
+    mutable ProgramTable m_programs;
+    ColumnAggregateIndex m_numberIndex;
+    FormulaArena m_formulaArena;
+    // Programs by the templateKey of their formula, so a formula written again at another cell reuses
+    // the program compiled for the first one. Entries of overwritten programs expire.
+    std::unordered_map<std::string, std::weak_ptr<ExprProgram>> m_templates;
+
+    // Evaluated results of formula cells. A formula cell is clean while it has an entry here,
+    // and every clean cell only depends on clean or cyclic cells, so invalidation can stop at dirty ones.
+    mutable std::unordered_map<std::pair<int, int>, CValue, PosHash> m_cache;
+    // Cells referred to directly, ranges are kept whole in m_rangePrecedents and indexed by the cells they cover.
+    // The graph is mutable because the formulas of an opened workbook are linked as their tiles are read.
+    mutable std::unordered_map<std::pair<int, int>, std::vector<std::pair<int, int>>, PosHash> m_precedents;
+    mutable std::unordered_map<std::pair<int, int>, posSet, PosHash> m_dependents;
+    mutable std::unordered_map<std::pair<int, int>, std::vector<RangeDependents::Range>, PosHash> m_rangePrecedents;
+    mutable RangeDependents m_rangeDependents;
+    // Cells lying on a reference cycle, kept up to date on every edit. Their value is always empty.
+    mutable posSet m_cyclic;
 
+    // Values as of the last publish, its versions share the tiles. Cells whose value may have changed
+    // since are collected in m_unpublished, unless the next publish reads the whole sheet anyway.
+    CellGrid<CValue> m_values;
+    posSet m_unpublished;
+    bool m_publishAll = true;
+    uint64_t m_versionCount = 0;
+    PublishedVersion m_published;
 
-    using cellValue = std::variant<std::monostate, double, std::string, std::shared_ptr<ExprNode>>;
-    std::map<std::pair<int, int>, cellValue> m_table;
+    CValue cellResult(const std::pair<int, int>& pos) const;
+    Operand cellOperand(const std::pair<int, int>& pos) const;
+    // Evaluations nested inside the one getValue started, only the thread calling getValue changes it.
+    mutable size_t m_evaluationDepth = 0;
+    static constexpr size_t MAX_NESTED_EVALUATIONS = 64;
+    // Below this many cells to evaluate the threads of recalculateAll cost more than they save
+    static constexpr size_t MIN_PARALLEL_CELLS = 1024;
+    void evaluatePrecedents(const std::pair<int, int>& pos) const;
+    // Reads count cells down column col from row for a column evaluation. isNumber tells which of them
+    // hold a number, stored or computed by a clean formula, the others are left to the scalar evaluator.
+    void columnValues(int row, int col, int count, double* values, unsigned char* isNumber) const;
+    // Evaluates sum, count, min, max or countval over the cells top..bottom x left..right.
+    CValue aggregateRange(OpCode fn, int top, int left, int bottom, int right, const CValue& needle) const;
+
+    // Operand stack of the formula interpreter, kept allocated between evaluations.
+    mutable std::vector<Operand> m_valueStack;
+
+private:
+    void copyFrom(const CSpreadsheet& other);
+    WorkbookContents contents() const;
+    static bool readIndexed(std::string_view data, const std::shared_ptr<std::pmr::memory_resource>& arena,
+                            std::vector<std::shared_ptr<ExprProgram>>& programs,
+                            std::vector<std::pair<std::pair<int, int>, cellValue>>& cells);
+    static bool readCompact(std::string_view data, const std::shared_ptr<std::pmr::memory_resource>& arena,
+                            std::vector<std::shared_ptr<ExprProgram>>& programs,
+                            std::vector<std::pair<std::pair<int, int>, cellValue>>& cells);
+    static cellValue compileCell(const std::pair<int, int>& pos, std::string contents,
+                                 const std::shared_ptr<std::pmr::memory_resource>& arena);
+    static std::optional<std::string> formulaTemplate(const std::pair<int, int>& pos, const std::string& contents);
+    std::shared_ptr<ExprProgram> findTemplate(const std::optional<std::string>& key) const;
+    void storeCell(const std::pair<int, int>& pos, std::string contents);
+    void putCell(const std::pair<int, int>& pos, cellValue val);
+    void eraseCells(int row, int col, int h, int w) const;
+    CellHandle encode(cellValue val) const;
+    cellValue decode(CellHandle cell) const;
+    const std::shared_ptr<ExprProgram>* programAt(const std::pair<int, int>& pos) const;
+    void formulaAllocated(size_t count = 1);
+    void cellChanged(const std::pair<int, int>& pos);
+    void recalculate(unsigned threads);
+    void backgroundLoop();
+    void notifySubscribers(std::unique_lock<std::mutex>& lock);
+    void unlinkPrecedents(const std::pair<int, int>& pos);
+    void linkPrecedents(const std::pair<int, int>& pos);
+    void linkPrecedents(const std::pair<int, int>& pos, const ExprProgram& program) const;
+    // Calls fn with the cells pos refers to. Of its ranges only the formulas are visited, the other cells
+    // have no precedents and are never dirty nor cyclic. A cell may be visited more than once.
+    template<typename F>
+    void forEachPrecedent(const std::pair<int, int>& pos, F&& fn) const;
+    // Calls fn with the formulas referring to pos, once for each reference or range they reach it through.
+    template<typename F>
+    void forEachDependent(const std::pair<int, int>& pos, F&& fn) const;
+    bool refersToItself(const std::pair<int, int>& pos) const;
+    void invalidate(const std::pair<int, int>& pos);
+    posSet stronglyConnected(const std::pair<int, int>& pos) const;
+    posSet connecting(const std::vector<std::pair<int, int>>& sources) const;
+    void markCycles(const posSet& nodes);
+    std::vector<std::vector<std::pair<int, int>>> dirtyLevels() const;
+    void rebuildDependencies();
+    void clear();
+    void pageIn(int row, int col, int h, int w) const;
+    void pageInTile(const std::pair<int, int>& tile) const;
+    void pageInAll() const;
+    std::vector<std::pair<int, int>> fileTiles(int row, int col, int h, int w) const;
+    template<typename F>
+    void forEachFileCell(const std::pair<int, int>& tile, int top, int left, int bottom, int right, F&& fn) const;
+    bool linkTile(const std::pair<int, int>& tile) const;
+    void linkAll() const;
+    void tileModified(const std::pair<int, int>& tile);
+    void trimTiles();
+
+    struct PagedFile;
+    // Workbook opened in paged mode, shared by copies of the sheet
+    std::shared_ptr<const PagedFile> m_pagedFile;
+    // Tiles of the file that are not in memory
+    mutable posSet m_pagedOut;
+    // Tiles of the file not checked yet, their formulas are not in the dependency graph
+    mutable posSet m_unlinked;
+    // Loaded tiles that were not modified since, they can be dropped and read again
+    mutable TileLru m_cleanTiles;
+    size_t m_maxTiles = 0;
 };
 
 #include "expressionBuilderAST.h"
+#include "workbookFormat.h"
+
+struct CSpreadsheet::PagedFile {
+    MappedFile file;
+    std::optional<WorkbookImage> image;
+
+    // Decodes a program of the file on first use. Copies of the sheet share it and may be used from other threads.
+    std::shared_ptr<ExprProgram> program(uint64_t index) const {
+        std::lock_guard guard(mutex);
+        auto& program = programs[index];
+        if (!program) {
+            program = image->program(index, arena);
+        }
+        return program;
+    }
+
+private:
+    mutable std::mutex mutex;
+    mutable std::unordered_map<uint64_t, std::shared_ptr<ExprProgram>> programs;
+    std::shared_ptr<std::pmr::memory_resource> arena = std::make_shared<std::pmr::monotonic_buffer_resource>();
+};
+
+CSpreadsheet::CSpreadsheet(const CSpreadsheet& other) {
+    auto lock = other.m_background.lock();
+    copyFrom(other);
+}
+
+CSpreadsheet& CSpreadsheet::operator=(const CSpreadsheet& other) {
+    if (this != &other) {
+        // The worker of this sheet would go on evaluating the cells being replaced
+        m_background.stop();
+        auto lock = other.m_background.lock();
+        copyFrom(other);
+    }
+    return *this;
+}
+
+// Copies everything but the worker. Subscriptions belong to the sheet object, their copy is empty.
+void CSpreadsheet::copyFrom(const CSpreadsheet& other) {
+    m_subscriptions = other.m_subscriptions;
+    m_numbers = other.m_numbers;
+    m_table = other.m_table;
+    m_texts = other.m_texts;
+    m_programs = other.m_programs;
+    m_numberIndex = other.m_numberIndex;
+    m_formulaArena = other.m_formulaArena;
+    m_templates = other.m_templates;
+    m_cache = other.m_cache;
+    m_precedents = other.m_precedents;
+    m_dependents = other.m_dependents;
+    m_rangePrecedents = other.m_rangePrecedents;
+    m_rangeDependents = other.m_rangeDependents;
+    m_cyclic = other.m_cyclic;
+    m_values = other.m_values;
+    m_unpublished = other.m_unpublished;
+    m_publishAll = other.m_publishAll;
+    m_versionCount = other.m_versionCount;
+    m_published = other.m_published;
+    m_evaluationDepth = other.m_evaluationDepth;
+    m_valueStack = other.m_valueStack;
+    m_pagedFile = other.m_pagedFile;
+    m_pagedOut = other.m_pagedOut;
+    m_unlinked = other.m_unlinked;
+    m_cleanTiles = other.m_cleanTiles;
+    m_maxTiles = other.m_maxTiles;
+}
 
 void CSpreadsheet::copyRect(CPos dst, CPos src, int w, int h) {
+    auto lock = m_background.lock();
+    linkAll();
     int srcRow = src.cPosHW.first;
     int srcCol = src.cPosHW.second;
     int dstRow = dst.cPosHW.first;
     int dstCol = dst.cPosHW.second;
+    pageIn(srcRow, srcCol, h, w);
+    pageIn(dstRow, dstCol, h, w);
+    // Erasing changes the destination tiles even where nothing is written back
+    if (m_pagedFile && h > 0 && w > 0) {
+        auto [firstRow, firstCol] = WorkbookImage::tileOf({dstRow, dstCol});
+        auto [lastRow, lastCol] = WorkbookImage::tileOf({dstRow + h - 1, dstCol + w - 1});
+        for (int tileRow = firstRow; tileRow <= lastRow; ++tileRow) {
+            for (int tileCol = firstCol; tileCol <= lastCol; ++tileCol) {
+                tileModified({tileRow, tileCol});
+            }
+        }
+    }
+
+    // Copy the source cells aside first to handle overlaps correctly
+    std::vector<std::pair<std::pair<int, int>, cellValue>> copied;
 
-    // Copy the source cells to a temporary map first to handle overlaps correctly
-    std::map<std::pair<int, int>, cellValue> tempMap;
+    m_numbers.forEachInRect(srcRow, srcCol, h, w, [&](const std::pair<int, int>& srcPos, double srcVal) {
+        copied.emplace_back(std::pair<int, int>(srcPos.first + dstRow - srcRow, srcPos.second + dstCol - srcCol), srcVal);
+    });
+    m_table.forEachInRect(srcRow, srcCol, h, w, [&](const std::pair<int, int>& srcPos, CellHandle srcVal) {
+        // Programs store relative references as offsets, so a copied formula shares the source program
+        copied.emplace_back(std::pair<int, int>(srcPos.first + dstRow - srcRow, srcPos.second + dstCol - srcCol), decode(srcVal));
+    });
 
+    // Clear the destination block, then write the copied content into it
+    m_numbers.eraseRect(dstRow, dstCol, h, w);
+    eraseCells(dstRow, dstCol, h, w);
+    for (auto& [dstPos, val] : copied) {
+        putCell(dstPos, std::move(val));
+    }
     for (int i = 0; i < h; ++i) {
         for (int j = 0; j < w; ++j) {
-            std::pair<int, int> srcPos = {srcRow + i, srcCol + j};
-            auto srcIt = m_table.find(srcPos);
-            if (srcIt != m_table.end()) {
-                const cellValue& srcVal = srcIt->second;
-                // Check for expression and clone if necessary
-                if (std::holds_alternative<std::shared_ptr<ExprNode>>(srcVal)) {
-                    std::shared_ptr<ExprNode> expr = std::get<std::shared_ptr<ExprNode>>(srcVal);
-                    std::string adjustedExpr = parseAndAdjustExpression(expr->strExpr, dstRow - srcRow, dstCol - srcCol);
-                    // Clone and set the modified expression string
-                    std::shared_ptr<ExprNode> clonedExpr = expr->clone();
-                    clonedExpr->strExpr = adjustedExpr;
-                    tempMap[{dstRow + i, dstCol + j}] = clonedExpr;
+            cellChanged({dstRow + i, dstCol + j});
+        }
+    }
+    notifySubscribers(lock);
+}
+
+WorkbookContents CSpreadsheet::contents() const {
+    WorkbookContents result;
+    auto& [strings, programs, programOffsets, cells] = result;
+    std::unordered_map<const ExprProgram*, uint32_t> programIndex;
+
+    // Cells filled by copyRect share their program, it is stored once
+    auto formulaCell = [&](const std::pair<int, int>& key, const ExprProgram& program) {
+        auto [it, inserted] = programIndex.emplace(&program, static_cast<uint32_t>(programOffsets.size()));
+        if (inserted) {
+            programOffsets.push_back(programs.data().size());
+            writeProgram(programs, program, strings);
+        }
+        cells.push_back({key, FormulaCell, m_cyclic.count(key) > 0, it->second});
+    };
+    m_numbers.forEach([&](const std::pair<int, int>& key, double num) {
+        cells.push_back({key, NumberCell, false, std::bit_cast<uint64_t>(num)});
+    });
+    m_table.forEach([&](const std::pair<int, int>& key, CellHandle val) {
+        if (val.isText()) {
+            cells.push_back({key, TextCell, false, strings.intern(m_texts[val.index()])});
+        } else {
+            formulaCell(key, *m_programs[val.index()]);
+        }
+    });
+    // Tiles of an opened workbook that are not in memory are copied from its file without loading them
+    if (m_pagedFile) {
+        linkAll();
+        const WorkbookImage& image = *m_pagedFile->image;
+        for (const auto& tile : m_pagedOut) {
+            WorkbookImage::Tile found = image.tile(image.tileLowerBound(tile));
+            for (uint32_t i = found.first; i < found.first + found.count; ++i) {
+                WorkbookImage::Cell cell = image.cell(i);
+                if (cell.type == TextCell) {
+                    cells.push_back({cell.pos, TextCell, false, strings.intern(image.string(cell.payload))});
+                } else if (cell.type == FormulaCell) {
+                    formulaCell(cell.pos, *m_pagedFile->program(cell.payload));
                 } else {
-                    tempMap[{dstRow + i, dstCol + j}] = srcVal; // Normal deep copy for non-expression types
+                    cells.push_back(cell);
                 }
             }
         }
     }
+    return result;
+}
 
-    // Now write the copied content to the destination cells
-    for (int i = 0; i < h; ++i) {
-        for (int j = 0; j < w; ++j) {
-            std::pair<int, int> dstPos = {dstRow + i, dstCol + j};
-            auto tempIt = tempMap.find({dstRow + i, dstCol + j});
-            if (tempIt != tempMap.end()) {
-                m_table[dstPos] = tempIt->second;
-            } else {
-                m_table.erase(dstPos); // Clear cells in the destination that don't match the source rectangle
+bool CSpreadsheet::save(std::ostream &os) const {
+    auto lock = m_background.lock();
+    try {
+        WorkbookContents all = contents();
+        auto& [strings, programs, programOffsets, cells] = all;
+        // Grouped by tile so a tile can be read in one piece, and sorted so readers find a cell by binary search
+        std::sort(cells.begin(), cells.end(), [](const WorkbookImage::Cell& a, const WorkbookImage::Cell& b) {
+            return std::pair(WorkbookImage::tileOf(a.pos), a.pos) < std::pair(WorkbookImage::tileOf(b.pos), b.pos);
+        });
+        std::vector<WorkbookImage::Tile> tiles;
+        for (uint32_t i = 0; i < cells.size(); ++i) {
+            if (tiles.empty() || tiles.back().pos != WorkbookImage::tileOf(cells[i].pos)) {
+                tiles.push_back({WorkbookImage::tileOf(cells[i].pos), i, 0, 0});
             }
+            tiles.back().count++;
         }
+
+        uint64_t stringsOffset = WORKBOOK_HEADER_SIZE;
+        uint64_t programsOffset = stringsOffset + strings.byteSize();
+        uint64_t programData = programsOffset + sizeof(uint64_t) * programOffsets.size();
+        uint64_t tilesOffset = programData + programs.data().size();
+        uint64_t cellsOffset = tilesOffset + WORKBOOK_TILE_SIZE * tiles.size();
+
+        WorkbookWriter out;
+        out.bytes(std::string_view(WORKBOOK_MAGIC, sizeof(WORKBOOK_MAGIC)));
+        out.u32(WORKBOOK_VERSION);
+        out.u32(static_cast<uint32_t>(strings.size()));
+        out.u32(static_cast<uint32_t>(programOffsets.size()));
+        out.u32(static_cast<uint32_t>(tiles.size()));
+        out.u32(static_cast<uint32_t>(cells.size()));
+        out.u64(stringsOffset);
+        out.u64(programsOffset);
+        out.u64(tilesOffset);
+        out.u64(cellsOffset);
+        strings.write(out, stringsOffset);
+        for (uint64_t offset : programOffsets) {
+            out.u64(programData + offset);
+        }
+        out.bytes(programs.data());
+        WorkbookWriter records;
+        for (const auto& cell : cells) {
+            records.i32(cell.pos.first);
+            records.i32(cell.pos.second);
+            records.u8(cell.type | (cell.cyclic ? WORKBOOK_CYCLIC : 0));
+            records.u64(cell.payload);
+        }
+        for (const auto& tile : tiles) {
+            out.i32(tile.pos.first);
+            out.i32(tile.pos.second);
+            out.u32(tile.first);
+            out.u32(tile.count);
+            out.u64(workbookChecksum(std::string_view(records.data()).substr(WORKBOOK_CELL_SIZE * tile.first,
+                                                                            WORKBOOK_CELL_SIZE * tile.count)));
+        }
+        out.bytes(records.data());
+        out.u64(workbookChecksum(out.data()));
+
+        os.write(out.data().data(), static_cast<std::streamsize>(out.data().size()));
+        return !os.fail();
+    } catch (...) {
+        return false; // Handle any kind of write failure
     }
 }
 
-bool CSpreadsheet::save(std::ostream &os) const {
+bool CSpreadsheet::saveCompact(std::ostream& os) const {
+    auto lock = m_background.lock();
     try {
-        for (const auto& [key, val] : m_table) {
-            // Write row and column
-            os.write(reinterpret_cast<const char*>(&key.first), sizeof(key.first));
-            os.write(reinterpret_cast<const char*>(&key.second), sizeof(key.second));
-
-            // Write the type of the value (double, string, or expression)
-            int type = val.index();
-            os.write(reinterpret_cast<const char*>(&type), sizeof(type));
-
-            if (type == 1) { // double
-                double num = std::get<double>(val);
-                os.write(reinterpret_cast<const char*>(&num), sizeof(num));
-            } else if (type == 2) { // string
-                const std::string& str = std::get<std::string>(val);
-                size_t len = str.length();
-                os.write(reinterpret_cast<const char*>(&len), sizeof(len)); // Write length of string
-                os.write(str.data(), str.size()); // Write string data
-            } else if (type == 3) { // expression (store as string)
-                std::shared_ptr<ExprNode> expr = std::get<std::shared_ptr<ExprNode>>(val);
-                const std::string& strExpr = expr->strExpr;
-                size_t len = strExpr.length();
-                os.write(reinterpret_cast<const char*>(&len), sizeof(len));
-                os.write(strExpr.data(), strExpr.size());
+        WorkbookContents all = contents();
+        auto& [strings, programs, programOffsets, cells] = all;
+        std::sort(cells.begin(), cells.end(), [](const WorkbookImage::Cell& a, const WorkbookImage::Cell& b) {
+            return a.pos < b.pos;
+        });
+
+        WorkbookWriter out;
+        out.bytes(std::string_view(WORKBOOK_COMPACT_MAGIC, sizeof(WORKBOOK_COMPACT_MAGIC)));
+        out.u32(WORKBOOK_COMPACT_VERSION);
+        strings.writeCompact(out);
+        out.varint(programOffsets.size());
+        out.bytes(programs.data());
+        out.varint(cells.size());
+        std::pair<int, int> prev = {0, -1};
+        for (const auto& cell : cells) {
+            uint8_t tag;
+            double num = std::bit_cast<double>(cell.payload);
+            // Integral values up to 2^53 are exact in an int64, -0 is not
+            bool integral = cell.type == NumberCell && std::fabs(num) <= 9007199254740992.0
+                            && num == static_cast<double>(static_cast<int64_t>(num)) && !(num == 0 && std::signbit(num));
+            if (cell.type == NumberCell) {
+                tag = integral ? CompactInteger : CompactNumber;
+            } else {
+                tag = cell.type == TextCell ? CompactText : CompactFormula;
+            }
+
+            if (cell.pos.first == prev.first && cell.pos.second == prev.second + 1) {
+                out.u8(tag | CompactNextColumn);
+            } else if (cell.pos.first == prev.first) {
+                out.u8(tag | CompactSameRow);
+                out.varint(static_cast<uint64_t>(static_cast<int64_t>(cell.pos.second) - prev.second - 2));
+            } else {
+                out.u8(tag | CompactNewRow);
+                out.varint(zigzag(static_cast<int64_t>(cell.pos.first) - prev.first));
+                out.varint(zigzag(cell.pos.second));
+            }
+            prev = cell.pos;
+
+            if (integral) {
+                out.varint(zigzag(static_cast<int64_t>(num)));
+            } else if (cell.type == NumberCell) {
+                out.u64(cell.payload);
+            } else {
+                out.varint(cell.payload);
             }
         }
-        return true;
+        out.u64(workbookChecksum(out.data()));
+
+        os.write(out.data().data(), static_cast<std::streamsize>(out.data().size()));
+        return !os.fail();
     } catch (...) {
-        return false; // Handle any kind of write failure
+        return false;
     }
 }
 
 bool CSpreadsheet::load(std::istream &is) {
+    auto lock = m_background.lock();
+    // Everything is read and checked before the sheet is touched, so a failed load leaves it unchanged
     try {
-        m_table.clear();
-        while (is.peek() != std::istream::traits_type::eof()) {
-            std::pair<int, int> key;
-            is.read(reinterpret_cast<char*>(&key.first), sizeof(key.first));
-            is.read(reinterpret_cast<char*>(&key.second), sizeof(key.second));
-
-            if (is.fail()) {
-                m_table.clear(); // Clear the table to remove partial data
-                return false; // Early exit on read failure
-            }
-
-            int type;
-            is.read(reinterpret_cast<char*>(&type), sizeof(type));
-            if (is.fail() || (type < 1 || type > 3)) {
-                m_table.clear();
-                return false; // Exit if the type is invalid
-            }
-
-            if (type == 1) { // double
-                double num;
-                is.read(reinterpret_cast<char*>(&num), sizeof(num));
-                if (is.fail()) return false;
-                m_table[key] = num;
-            } else if (type == 2 || type == 3) { // string or expression
-                size_t len;
-                is.read(reinterpret_cast<char*>(&len), sizeof(len));
-                if (is.fail() || len > 1000000) { // Arbitrary large length check
-                    m_table.clear();
-                    return false; // Prevent buffer overflow or invalid length
-                }
-                std::string str(len, '\0');
-                is.read(str.data(), len);
-                if (is.fail()) {
-                    m_table.clear();
-                    return false; // If read fails, cleanup and exit
-                }
-                if (type == 3) {
-                    setCell(CPos(key.first, key.second), str); // Assumes setCell can handle expressions correctly
-                } else {
-                    m_table[key] = str;
+        std::ostringstream buffer;
+        buffer << is.rdbuf();
+        std::string data = buffer.str();
+        if (is.bad()) {
+            return false;
+        }
+
+        // Formulas are stored compiled, so nothing is parsed here
+        auto arena = std::make_shared<std::pmr::monotonic_buffer_resource>();
+        std::vector<std::shared_ptr<ExprProgram>> programs;
+        std::vector<std::pair<std::pair<int, int>, cellValue>> cells;
+        bool read = std::string_view(data).starts_with(std::string_view(WORKBOOK_COMPACT_MAGIC, sizeof(WORKBOOK_COMPACT_MAGIC)))
+                    ? readCompact(data, arena, programs, cells)
+                    : readIndexed(data, arena, programs, cells);
+        if (!read) {
+            return false;
+        }
+
+        clear();
+        m_formulaArena.reset(std::move(arena), programs.size());
+        for (auto& [key, val] : cells) {
+            putCell(key, std::move(val));
+        }
+        rebuildDependencies();
+    } catch (...) {
+        return false; // Truncated or malformed data
+    }
+    notifySubscribers(lock);
+    return true;
+}
+
+bool CSpreadsheet::readIndexed(std::string_view data, const std::shared_ptr<std::pmr::memory_resource>& arena,
+                               std::vector<std::shared_ptr<ExprProgram>>& programs,
+                               std::vector<std::pair<std::pair<int, int>, cellValue>>& cells) {
+    WorkbookImage image(data);
+    if (!image.checksumValid()) {
+        return false; // Corrupted or truncated file
+    }
+    programs.resize(image.programCount());
+    for (uint32_t i = 0; i < programs.size(); ++i) {
+        programs[i] = image.program(i, arena);
+    }
+
+    cells.resize(image.cellCount());
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        WorkbookImage::Cell cell = image.cell(i);
+        cells[i].first = cell.pos;
+        if (cell.type == NumberCell) {
+            cells[i].second = std::bit_cast<double>(cell.payload);
+        } else if (cell.type == TextCell) {
+            cells[i].second = std::string(image.string(cell.payload));
+        } else if (cell.type == FormulaCell && cell.payload < programs.size()) {
+            cells[i].second = programs[cell.payload];
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CSpreadsheet::readCompact(std::string_view data, const std::shared_ptr<std::pmr::memory_resource>& arena,
+                               std::vector<std::shared_ptr<ExprProgram>>& programs,
+                               std::vector<std::pair<std::pair<int, int>, cellValue>>& cells) {
+    if (data.size() < sizeof(WORKBOOK_COMPACT_MAGIC) + sizeof(uint32_t) + sizeof(uint64_t)) {
+        return false;
+    }
+    std::string_view body = data.substr(0, data.size() - sizeof(uint64_t));
+    if (WorkbookReader(data.substr(body.size())).u64() != workbookChecksum(body)) {
+        return false;
+    }
+    WorkbookReader in(body);
+    in.bytes(sizeof(WORKBOOK_COMPACT_MAGIC));
+    if (in.u32() != WORKBOOK_COMPACT_VERSION) {
+        return false;
+    }
+
+    std::vector<std::string_view> strings(in.varcount());
+    for (auto& str : strings) {
+        str = in.bytes(in.varint());
+    }
+    auto stringAt = [&](uint64_t index) {
+        if (index >= strings.size()) {
+            throw std::runtime_error("String index out of range");
+        }
+        return strings[index];
+    };
+    programs.resize(in.varcount());
+    for (auto& program : programs) {
+        program = readProgram(in, stringAt, arena);
+    }
+
+    cells.resize(in.varcount());
+    long long row = 0;
+    long long col = -1;
+    for (auto& [pos, val] : cells) {
+        uint8_t tag = in.u8();
+        switch (tag & ~3) {
+            case CompactNextColumn:
+                col++;
+                break;
+            case CompactSameRow:
+                col += static_cast<long long>(std::min<uint64_t>(in.varint(), UINT32_MAX)) + 2;
+                break;
+            case CompactNewRow:
+                row += std::clamp<int64_t>(unzigzag(in.varint()), -(1LL << 32), 1LL << 32);
+                col = std::clamp<int64_t>(unzigzag(in.varint()), -(1LL << 32), 1LL << 32);
+                break;
+            default:
+                return false;
+        }
+        if (row < INT_MIN || row > INT_MAX || col < INT_MIN || col > INT_MAX) {
+            return false;
+        }
+        pos = {static_cast<int>(row), static_cast<int>(col)};
+
+        switch (tag & 3) {
+            case CompactNumber:
+                val = in.f64();
+                break;
+            case CompactInteger:
+                val = static_cast<double>(unzigzag(in.varint()));
+                break;
+            case CompactText:
+                val = std::string(stringAt(in.varint()));
+                break;
+            default:
+                uint64_t index = in.varint();
+                if (index >= programs.size()) {
+                    return false;
                 }
+                val = programs[index];
+                break;
+        }
+    }
+    return in.remaining() == 0;
+}
+
+bool CSpreadsheet::open(const std::string& fileName, size_t maxTiles) {
+    auto lock = m_background.lock();
+    // Like load, what is read here is checked before the sheet is touched
+    try {
+        auto paged = std::make_shared<PagedFile>();
+        if (!paged->file.open(fileName)) {
+            return false;
+        }
+        const WorkbookImage& image = paged->image.emplace(paged->file.data());
+        // Only the directory is read here. A tile is checked against its checksum and its formulas are
+        // linked when it is first read, or before the first edit, which may reach any of them.
+        posSet tiles;
+        uint32_t next = 0;
+        for (uint32_t t = 0; t < image.tileCount(); ++t) {
+            WorkbookImage::Tile tile = image.tile(t);
+            if (tile.first != next || (t > 0 && !(image.tile(t - 1).pos < tile.pos))) {
+                return false;
             }
+            next += tile.count;
+            tiles.insert(tile.pos);
+        }
+        if (next != image.cellCount()) {
+            return false;
         }
-        return !is.fail();
+
+        clear();
+        m_pagedFile = std::move(paged);
+        m_pagedOut = tiles;
+        m_unlinked = std::move(tiles);
+        m_maxTiles = maxTiles;
     } catch (...) {
-        m_table.clear(); // Clear any partial data on exceptions
-        return false; // Return failure on exception
+        return false; // Malformed file
     }
+    notifySubscribers(lock);
+    return true;
 }
 
 bool CSpreadsheet::setCell (CPos pos, std::string contents) {
-    int row = pos.cPosHW.first;
-    int col = pos.cPosHW.second;
+    auto lock = m_background.lock();
+    linkAll();
+    storeCell(pos.cPosHW, std::move(contents));
+    cellChanged(pos.cPosHW);
+    notifySubscribers(lock);
+    return true;
+}
 
-    try {
-        size_t idx;
-        double numValue = std::stod(contents, &idx);
-        if (idx == contents.size()) { // Entire string was successfully converted to a number
-            m_table[pos.cPosHW] = numValue;
-            return true;
+bool CSpreadsheet::setCells(std::span<const std::pair<CPos, std::string>> cells, unsigned threads) {
+    auto lock = m_background.lock();
+    linkAll();
+    // Below this many formulas the threads cost more than they save
+    constexpr size_t MIN_PARALLEL_FORMULAS = 256;
+    // Cells a worker claims at once
+    constexpr size_t CHUNK = 64;
+
+    // Formulas with a known template take its program, of the others only the first cell with each template
+    // compiles and the rest copy its program from there
+    std::vector<cellValue> values(cells.size());
+    std::vector<size_t> source(cells.size());
+    std::vector<std::optional<std::string>> keys(cells.size());
+    std::unordered_map<std::string_view, size_t> firstWithKey;
+    size_t formulas = 0;
+    for (size_t i = 0; i < cells.size(); ++i) {
+        source[i] = i;
+        keys[i] = formulaTemplate(cells[i].first.cPosHW, cells[i].second);
+        if (std::shared_ptr<ExprProgram> program = findTemplate(keys[i])) {
+            values[i] = std::move(program);
+            continue;
         }
-    } catch (...) {
-        // Ignore
+        if (keys[i]) {
+            source[i] = firstWithKey.emplace(*keys[i], i).first->second;
+        }
+        formulas += source[i] == i && !cells[i].second.empty() && cells[i].second[0] == '=';
     }
+    size_t workers = formulas < MIN_PARALLEL_FORMULAS ? 1 : std::max(1u, threads);
 
-    if (contents[0] == '=') {
-        ASTBuilder builder(row, col, *this);
-        parseExpression(contents, builder); // Assume this parses and builds the AST
-        auto expr = builder.getExpression();
-        expr->strExpr = contents;
-        m_table[pos.cPosHW] = expr;
-    } else {
-        m_table[pos.cPosHW] = contents;
+    // Each worker allocates its programs from an arena of its own, the programs keep it alive
+    std::atomic<size_t> claimed = 0;
+    std::atomic<bool> failed = false;
+    auto work = [&]() {
+        auto arena = workers == 1 ? m_formulaArena.resource() : std::make_shared<std::pmr::monotonic_buffer_resource>();
+        for (size_t begin = claimed.fetch_add(CHUNK); begin < cells.size() && !failed; begin = claimed.fetch_add(CHUNK)) {
+            for (size_t i = begin; i < std::min(cells.size(), begin + CHUNK); ++i) {
+                if (source[i] != i || !std::holds_alternative<std::monostate>(values[i])) {
+                    continue;
+                }
+                try {
+                    values[i] = compileCell(cells[i].first.cPosHW, cells[i].second, arena);
+                } catch (...) {
+                    failed = true;
+                }
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < workers; ++i) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    if (failed) {
+        return false;
+    }
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (source[i] != i) {
+            values[i] = values[source[i]];
+        } else if (keys[i] && std::holds_alternative<std::shared_ptr<ExprProgram>>(values[i])) {
+            m_templates[std::move(*keys[i])] = std::get<std::shared_ptr<ExprProgram>>(values[i]);
+        }
     }
 
+    // Cells written more than once are changed once, the last write wins like it would with setCell
+    posSet seen;
+    std::vector<std::pair<int, int>> changed;
+    std::vector<std::pair<int, int>> wasCyclic;
+    for (const auto& [pos, contents] : cells) {
+        if (seen.insert(pos.cPosHW).second) {
+            changed.push_back(pos.cPosHW);
+            if (m_cyclic.count(pos.cPosHW)) {
+                wasCyclic.push_back(pos.cPosHW);
+            }
+        }
+    }
+    // Same as in cellChanged, but the cycles are looked up once for the whole batch
+    posSet candidates = connecting(wasCyclic);
+    for (size_t i = 0; i < cells.size(); ++i) {
+        putCell(cells[i].first.cPosHW, std::move(values[i]));
+    }
+    formulaAllocated(formulas);
+    // As in cellChanged, a value that was not on a cycle cannot be on one now, so only the others are searched from
+    std::vector<std::pair<int, int>> sources;
+    for (const auto& pos : changed) {
+        unlinkPrecedents(pos);
+        linkPrecedents(pos);
+        m_numberIndex.invalidate(pos);
+        if (m_cyclic.count(pos) || programAt(pos)) {
+            sources.push_back(pos);
+        }
+    }
+    posSet current = connecting(sources);
+    candidates.insert(current.begin(), current.end());
+    candidates.insert(sources.begin(), sources.end());
+    markCycles(candidates);
+    for (const auto& pos : changed) {
+        invalidate(pos);
+    }
+    notifySubscribers(lock);
     return true;
 }
 
-CValue CSpreadsheet::getValue (CPos pos) {
-    auto it = m_table.find(pos.cPosHW);
-    CValue result;
-    globalCount++;
-
-    if (globalCount > 60) {return CValue();}
-
-    if (it == m_table.end()) {
-        result = {};
-    } else if (std::holds_alternative<double>(m_table[pos.cPosHW])) {
-        result = std::get<double>(it->second);
-    } else if (std::holds_alternative<std::string>(m_table[pos.cPosHW])){
-        result = std::get<std::string>(it->second);
-    } else if (std::holds_alternative<std::shared_ptr<ExprNode>>(m_table[pos.cPosHW])) {
-        auto& expr = std::get<std::shared_ptr<ExprNode>>(m_table[pos.cPosHW]);
-        if (expr) { // Check if the shared_ptr actually points to an object
-            ExpressionResult resultExp = expr->evaluate(*this, pos.cPosHW.first, pos.cPosHW.second);
-            if (std::holds_alternative<double>(resultExp)) {
-                result = std::get<double>(resultExp);
-            } else if (std::holds_alternative<std::string>(resultExp)) {
-                result = std::get<std::string>(resultExp);
-            }
-        }
-    }
-    globalCount = 0;
-    return result;
+// Turns cell contents into the stored value: a number, a text or a formula compiled into arena.
+// Throws when a formula cannot be parsed.
+CSpreadsheet::cellValue CSpreadsheet::compileCell(const std::pair<int, int>& pos, std::string contents,
+                                                  const std::shared_ptr<std::pmr::memory_resource>& arena) {
+    if (std::optional<double> num = parseNumber(contents)) {
+        return *num;
+    }
+    if (contents[0] != '=') {
+        return contents;
+    }
+    ASTBuilder builder(pos.first, pos.second, arena);
+    parseExpression(contents, builder);
+    auto expr = builder.getExpression();
+    expr->strExpr = contents;
+    expr->originRow = pos.first;
+    expr->originCol = pos.second;
+    return expr;
+}
+
+// Returns the template key of contents written at pos, nothing if they are not a formula that can be shared.
+std::optional<std::string> CSpreadsheet::formulaTemplate(const std::pair<int, int>& pos, const std::string& contents) {
+    if (contents.empty() || contents[0] != '=') {
+        return std::nullopt;
+    }
+    return templateKey(contents, pos.first, pos.second);
+}
+
+std::shared_ptr<ExprProgram> CSpreadsheet::findTemplate(const std::optional<std::string>& key) const {
+    if (!key) {
+        return nullptr;
+    }
+    auto it = m_templates.find(*key);
+    return it == m_templates.end() ? nullptr : it->second.lock();
+}
+
+void CSpreadsheet::storeCell(const std::pair<int, int>& pos, std::string contents) {
+    std::optional<std::string> key = formulaTemplate(pos, contents);
+    if (std::shared_ptr<ExprProgram> program = findTemplate(key)) {
+        putCell(pos, std::move(program));
+        return;
+    }
+    cellValue val = compileCell(pos, std::move(contents), m_formulaArena.resource());
+    bool formula = std::holds_alternative<std::shared_ptr<ExprProgram>>(val);
+    if (formula && key) {
+        m_templates[std::move(*key)] = std::get<std::shared_ptr<ExprProgram>>(val);
+    }
+    putCell(pos, std::move(val));
+    if (formula) {
+        formulaAllocated();
+    }
 }
 
+void CSpreadsheet::putCell(const std::pair<int, int>& pos, cellValue val) {
+    if (m_pagedFile) {
+        pageIn(pos.first, pos.second, 1, 1);
+        tileModified(WorkbookImage::tileOf(pos));
+    }
+    // The new text or program is taken before the old one is let go, they may be the same entry
+    CellHandle handle;
+    bool number = std::holds_alternative<double>(val);
+    if (number) {
+        m_numbers[pos] = std::get<double>(val);
+    } else {
+        handle = encode(std::move(val));
+        m_numbers.erase(pos);
+    }
+    eraseCells(pos.first, pos.second, 1, 1);
+    if (!number) {
+        m_table[pos] = handle;
+    }
+}
+
+// Removes the texts and formulas of the h x w rectangle at (row, col), releasing what they refer to.
+void CSpreadsheet::eraseCells(int row, int col, int h, int w) const {
+    m_table.forEachInRect(row, col, h, w, [&](const std::pair<int, int>&, CellHandle cell) {
+        if (cell.isText()) {
+            m_texts.release(cell.index());
+        } else if (cell.isFormula()) {
+            m_programs.release(cell.index());
+        }
+    });
+    if (h == 1 && w == 1) {
+        m_table.erase({row, col});
+    } else {
+        m_table.eraseRect(row, col, h, w);
+    }
+}
+
+// Stores the text or program of val in its table and returns the handle referring to it.
+// Numbers go to m_numbers instead, val holds one of the other two.
+CellHandle CSpreadsheet::encode(cellValue val) const {
+    if (std::string* text = std::get_if<std::string>(&val)) {
+        return CellHandle::text(m_texts.acquire(std::move(*text)));
+    }
+    return CellHandle::formula(m_programs.acquire(std::get<std::shared_ptr<ExprProgram>>(std::move(val))));
+}
+
+CSpreadsheet::cellValue CSpreadsheet::decode(CellHandle cell) const {
+    if (cell.isText()) {
+        return m_texts[cell.index()];
+    }
+    return m_programs[cell.index()];
+}
+
+const std::shared_ptr<ExprProgram>* CSpreadsheet::programAt(const std::pair<int, int>& pos) const {
+    const CellHandle* cell = m_table.find(pos);
+    return cell && cell->isFormula() ? &m_programs[cell->index()] : nullptr;
+}
+
+// Counts a program allocated from the arena. Overwritten formulas leave their memory in the buffer,
+// so once it holds more dead programs than live ones the live ones are copied into a fresh buffer.
+void CSpreadsheet::formulaAllocated(size_t count) {
+    m_formulaArena.programs += count;
+    if (m_formulaArena.programs < m_formulaArena.compactAt) {
+        return;
+    }
+    std::erase_if(m_templates, [](const auto& entry) { return entry.second.expired(); });
+    if (m_formulaArena.programs > 2 * m_programs.size()) {
+        m_formulaArena.reset();
+        // Cells sharing a program refer to one entry, so they keep sharing its copy. The originals
+        // are held until the templates pointing at them are moved over too.
+        std::unordered_map<const ExprProgram*, std::shared_ptr<ExprProgram>> moved;
+        std::vector<std::pair<uint32_t, std::shared_ptr<ExprProgram>>> live;
+        m_programs.forEach([&](uint32_t index, const std::shared_ptr<ExprProgram>& program) {
+            live.emplace_back(index, program);
+        });
+        for (const auto& [index, program] : live) {
+            auto copy = program->clone(m_formulaArena.resource());
+            m_formulaArena.programs++;
+            moved.emplace(program.get(), copy);
+            m_programs.replace(index, std::move(copy));
+        }
+        for (auto& [key, program] : m_templates) {
+            auto copy = moved.find(program.lock().get());
+            if (copy != moved.end()) {
+                program = copy->second;
+            }
+        }
+    }
+    m_formulaArena.compactAt = std::max(FormulaArena::MIN_COMPACT, 2 * m_formulaArena.programs);
+}
+
+CValue CSpreadsheet::getValue (CPos pos) {
+    auto lock = m_background.lock();
+    CValue value = cellResult(pos.cPosHW);
+    trimTiles();
+    return value;
+}
+
+std::future<CValue> CSpreadsheet::getValueAsync(CPos pos) {
+    std::promise<CValue> promise;
+    std::future<CValue> result = promise.get_future();
+    auto lock = m_background.lock();
+    const std::pair<int, int>& cell = pos.cPosHW;
+    pageIn(cell.first, cell.second, 1, 1);
+    if (m_cache.count(cell) || m_cyclic.count(cell) || !programAt(cell)) {
+        promise.set_value(cellResult(cell));
+        trimTiles();
+        return result;
+    }
+    m_background.requests.push_back({cell, std::move(promise)});
+    if (!m_background.running()) {
+        m_background.start([this] { backgroundLoop(); });
+    }
+    m_background.wake.notify_one();
+    return result;
+}
+
+size_t CSpreadsheet::subscribe(CPos pos, int w, int h, CellSubscriptions::Callback callback) {
+    auto lock = m_background.lock();
+    auto [row, col] = pos.cPosHW;
+    for (int r = row; r < row + h; ++r) {
+        for (int c = col; c < col + w; ++c) {
+            bool watched = m_subscriptions.watches.find({r, c}) != nullptr;
+            CellSubscriptions::Watch& watch = m_subscriptions.watches[{r, c}];
+            if (!watched) {
+                watch.value = cellResult({r, c});
+            }
+            watch.count++;
+        }
+    }
+    size_t id = m_subscriptions.nextId++;
+    m_subscriptions.subscriptions.emplace(id, CellSubscriptions::Subscription{row, col, h, w, std::move(callback)});
+    trimTiles();
+    return id;
+}
+
+void CSpreadsheet::unsubscribe(size_t id) {
+    auto lock = m_background.lock();
+    auto it = m_subscriptions.subscriptions.find(id);
+    if (it == m_subscriptions.subscriptions.end()) {
+        return;
+    }
+    const CellSubscriptions::Subscription& sub = it->second;
+    for (int r = sub.row; r < sub.row + sub.h; ++r) {
+        for (int c = sub.col; c < sub.col + sub.w; ++c) {
+            if (--m_subscriptions.watches[{r, c}].count == 0) {
+                m_subscriptions.watches.erase({r, c});
+            }
+        }
+    }
+    m_subscriptions.subscriptions.erase(it);
+}
+
+// Ends an edit. The watched cells it invalidated are evaluated, and each subscription covering some whose value
+// differs from the one last reported gets them in one call, made once the lock is released.
+void CSpreadsheet::notifySubscribers(std::unique_lock<std::mutex>& lock) {
+    std::vector<std::pair<int, int>> cells = std::move(m_subscriptions.pending);
+    m_subscriptions.pending.clear();
+    if (m_subscriptions.all) {
+        cells.clear();
+        m_subscriptions.watches.forEach([&](const std::pair<int, int>& pos, const CellSubscriptions::Watch&) {
+            cells.push_back(pos);
+        });
+        m_subscriptions.all = false;
+    }
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+
+    std::map<size_t, std::vector<std::pair<CPos, CValue>>> batches;
+    for (const auto& pos : cells) {
+        CValue value = cellResult(pos);
+        CellSubscriptions::Watch& watch = m_subscriptions.watches[pos];
+        // NaN is not equal to itself, but it is no change either
+        bool same = value == watch.value || (std::holds_alternative<double>(value) && std::holds_alternative<double>(watch.value)
+                                             && std::isnan(std::get<double>(value)) && std::isnan(std::get<double>(watch.value)));
+        if (same) {
+            continue;
+        }
+        watch.value = value;
+        for (const auto& [id, sub] : m_subscriptions.subscriptions) {
+            if (pos.first >= sub.row && pos.first < sub.row + sub.h && pos.second >= sub.col && pos.second < sub.col + sub.w) {
+                batches[id].emplace_back(CPos(pos.first, pos.second), value);
+            }
+        }
+    }
+    trimTiles();
+    // Callbacks are copied, so they may subscribe or unsubscribe
+    std::vector<std::pair<CellSubscriptions::Callback, std::vector<std::pair<CPos, CValue>>>> calls;
+    for (auto& [id, changes] : batches) {
+        calls.emplace_back(m_subscriptions.subscriptions.at(id).callback, std::move(changes));
+    }
+    lock.unlock();
+    for (const auto& [callback, changes] : calls) {
+        callback(changes);
+    }
+}
+
+// Body of the background worker. Between two steps it lets the lock go, so the thread owning the sheet
+// waits for one requested cell or one slice of dirty cells at most.
+void CSpreadsheet::backgroundLoop() {
+    // Dirty cells evaluated in one step
+    constexpr size_t SLICE = 64;
+    auto lock = m_background.lock();
+    while (true) {
+        m_background.wake.wait(lock, [&] {
+            return m_background.stopping || m_background.reseed || !m_background.requests.empty()
+                   || !m_background.dirty.empty();
+        });
+        if (!m_background.requests.empty()) {
+            BackgroundRecalc::Request request = std::move(m_background.requests.front());
+            m_background.requests.pop_front();
+            try {
+                request.promise.set_value(cellResult(request.pos));
+            } catch (...) {
+                request.promise.set_exception(std::current_exception());
+            }
+        } else if (m_background.stopping) {
+            return;
+        } else if (m_background.reseed) {
+            // Level by level, so each cell finds its precedents already evaluated
+            m_background.reseed = false;
+            m_background.dirty.clear();
+            for (const auto& level : dirtyLevels()) {
+                m_background.dirty.insert(m_background.dirty.end(), level.begin(), level.end());
+            }
+        } else {
+            for (size_t i = 0; i < SLICE && !m_background.dirty.empty(); ++i) {
+                std::pair<int, int> cell = m_background.dirty.front();
+                m_background.dirty.pop_front();
+                try {
+                    cellResult(cell);
+                } catch (...) {
+                    // Left dirty, the next getValue of the cell reports the error
+                }
+            }
+        }
+        trimTiles();
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+    }
+}
+
+CValue CSpreadsheet::cellResult(const std::pair<int, int>& pos) const {
+    if (m_pagedFile) {
+        // A cached result stays valid after its tile was dropped, so it is answered without reading the file
+        auto cached = m_cache.find(pos);
+        if (cached != m_cache.end()) {
+            return cached->second;
+        }
+        pageIn(pos.first, pos.second, 1, 1);
+    }
+    if (const double* num = m_numbers.find(pos)) {
+        return *num;
+    }
+    const CellHandle* cell = m_table.find(pos);
+    if (!cell) {
+        return CValue();
+    }
+    if (cell->isText()) {
+        return m_texts[cell->index()];
+    }
+    // Evaluation does not change the cells, so the program stays in its table meanwhile
+    const ExprProgram* program = m_programs[cell->index()].get();
+
+    auto cached = m_cache.find(pos);
+    if (cached != m_cache.end()) {
+        return cached->second;
+    }
+    if (m_cyclic.count(pos)) {
+        return CValue();
+    }
+
+    // Each reference to a dirty formula nests another evaluation, past a few levels the rest of the chain
+    // is evaluated from its far end instead, so the nesting stays bounded however long the chain
+    if (m_evaluationDepth >= MAX_NESTED_EVALUATIONS) {
+        evaluatePrecedents(pos);
+    }
+    m_evaluationDepth++;
+    CValue result = program->evaluate(*this, pos.first, pos.second);
+    m_evaluationDepth--;
+    m_cache.emplace(pos, result);
+    return result;
+}
+
+// Value of the cell as an operand of a formula. Texts and cached results are viewed where they are stored,
+// nothing removes them while formulas are evaluated. A paged sheet reads through cellResult, which
+// answers cached results without loading the tile.
+Operand CSpreadsheet::cellOperand(const std::pair<int, int>& pos) const {
+    const CellHandle* cell = m_pagedFile ? nullptr : m_table.find(pos);
+    if (cell && cell->isText()) {
+        return std::string_view(m_texts[cell->index()]);
+    }
+    if (cell && cell->isFormula()) {
+        auto cached = m_cache.find(pos);
+        if (cached != m_cache.end()) {
+            if (const std::string* text = std::get_if<std::string>(&cached->second)) {
+                return std::string_view(*text);
+            }
+            return toOperand(cached->second);
+        }
+    }
+    return toOperand(cellResult(pos));
+}
+
+// Evaluates the dirty formulas pos depends on in post order, walking the precedents with an explicit
+// stack. Each of them is evaluated once all of its own precedents are clean, so it reads cached results only.
+// Dirty cells are not on a cycle, so none is reached again while it is on the stack.
+void CSpreadsheet::evaluatePrecedents(const std::pair<int, int>& pos) const {
+    struct Frame {
+        std::pair<int, int> pos;
+        std::vector<std::pair<int, int>> precedents;
+        size_t next;
+    };
+    // The cyclic flag of a formula in a tile read for the first time is known once it is loaded
+    auto dirty = [&](const std::pair<int, int>& cell) {
+        if (m_cache.count(cell)) {
+            return false;
+        }
+        pageIn(cell.first, cell.second, 1, 1);
+        return !m_cyclic.count(cell) && programAt(cell) != nullptr;
+    };
+    std::vector<Frame> callStack;
+    auto push = [&](const std::pair<int, int>& cell) {
+        callStack.push_back({cell, {}, 0});
+        forEachPrecedent(cell, [&](const std::pair<int, int>& precedent) {
+            callStack.back().precedents.push_back(precedent);
+        });
+    };
+    push(pos);
+    while (!callStack.empty()) {
+        Frame& frame = callStack.back();
+        if (frame.next < frame.precedents.size()) {
+            std::pair<int, int> next = frame.precedents[frame.next++];
+            if (dirty(next)) {
+                push(next);
+            }
+            continue;
+        }
+        std::pair<int, int> done = frame.pos;
+        callStack.pop_back();
+        if (done != pos) {
+            cellResult(done);
+        }
+    }
+}
+
+void CSpreadsheet::columnValues(int row, int col, int count, double* values, unsigned char* isNumber) const {
+    std::fill_n(isNumber, count, 0);
+    m_numbers.forEachSpan(row, col, count, 1, [&](const std::pair<int, int>& start, const double* cells,
+                                                  const unsigned char* used, int) {
+        values[start.first - row] = cells[0];
+        isNumber[start.first - row] = used[0];
+    });
+    for (int k = 0; k < count; ++k) {
+        if (isNumber[k] || !m_table.find({row + k, col})) {
+            continue;
+        }
+        CValue val = cellResult({row + k, col});
+        if (const double* num = std::get_if<double>(&val)) {
+            values[k] = *num;
+            isNumber[k] = 1;
+        }
+    }
+}
+
+// Accumulates the aggregate functions over the values of a range.
+struct RangeAggregate {
+    double sum = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    size_t numbers = 0;
+    size_t values = 0;
+    size_t matches = 0;
+
+    // Consumes a span of the number lane. Unused slots hold 0.0, so the sum needs no mask,
+    // and the loop has no data dependent branches, which lets the compiler vectorize it.
+    void addNumbers(const double* cells, const unsigned char* used, int len, const double* needle) {
+        double lanes[4] = {0, 0, 0, 0};
+        size_t count = 0;
+        size_t found = 0;
+        double lo = min;
+        double hi = max;
+        double match = needle ? *needle : 0;
+        for (int k = 0; k < len; ++k) {
+            double x = cells[k];
+            bool u = used[k];
+            lanes[k & 3] += x;
+            count += u;
+            found += u && x == match;
+            lo = u && x < lo ? x : lo;
+            hi = u && x > hi ? x : hi;
+        }
+        sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        numbers += count;
+        values += count;
+        matches += needle ? found : 0;
+        min = lo;
+        max = hi;
+    }
+
+    void addSummary(const ColumnAggregateIndex::Summary& summary) {
+        sum += summary.sum;
+        numbers += summary.count;
+        values += summary.count;
+        min = std::min(min, summary.min);
+        max = std::max(max, summary.max);
+    }
+
+    void addValue(const CValue& val, const CValue& needle) {
+        if (std::holds_alternative<std::monostate>(val)) {
+            return;
+        }
+        values++;
+        if (const double* num = std::get_if<double>(&val)) {
+            sum += *num;
+            numbers++;
+            min = std::min(min, *num);
+            max = std::max(max, *num);
+        }
+        if (val == needle) {
+            matches++;
+        }
+    }
+
+    // Value of function fn over an h x w range with everything added.
+    CValue result(OpCode fn, int h, int w, const CValue& needle) const {
+        switch (fn) {
+            case OpCode::Sum:
+                return numbers ? CValue(sum) : CValue();
+            case OpCode::Min:
+                return numbers ? CValue(min) : CValue();
+            case OpCode::Max:
+                return numbers ? CValue(max) : CValue();
+            case OpCode::Count:
+                return static_cast<double>(values);
+            case OpCode::CountVal:
+                if (std::holds_alternative<std::monostate>(needle)) {
+                    return static_cast<double>(h) * w - static_cast<double>(values);
+                }
+                return static_cast<double>(matches);
+            default:
+                return CValue();
+        }
+    }
+};
+
+CValue CSpreadsheet::aggregateRange(OpCode fn, int top, int left, int bottom, int right, const CValue& needle) const {
+    int h = bottom - top + 1;
+    int w = right - left + 1;
+    RangeAggregate agg;
+    const double* numNeedle = std::get_if<double>(&needle);
+    // Tiles of an opened workbook still in the file are read from it, loading them all would evict the tiles
+    // in use. Only their uncached formulas load a tile, to be evaluated. The tiles loaded meanwhile are
+    // still read from the file, so no cell is counted twice.
+    std::vector<std::pair<int, int>> inFile = fileTiles(top, left, h, w);
+    auto loaded = [&](const std::pair<int, int>& pos) {
+        return inFile.empty() || !std::binary_search(inFile.begin(), inFile.end(), WorkbookImage::tileOf(pos));
+    };
+
+    // The index summarizes the numbers in memory, so it only serves ranges without tiles in the file
+    if (fn != OpCode::CountVal && h >= ColumnAggregateIndex::MIN_ROWS && inFile.empty()) {
+        for (int col = left; col <= right; ++col) {
+            agg.addSummary(m_numberIndex.query(m_numbers, top, bottom, col));
+        }
+    } else {
+        m_numbers.forEachSpan(top, left, h, w, [&](const std::pair<int, int>& start, const double* cells, const unsigned char* used, int len) {
+            if (loaded(start)) {
+                agg.addNumbers(cells, used, len, numNeedle);
+            }
+        });
+    }
+    m_table.forEachInRect(top, left, h, w, [&](const std::pair<int, int>& pos, CellHandle cell) {
+        if (!loaded(pos)) {
+            return;
+        }
+        if (cell.isText()) {
+            agg.addValue(m_texts[cell.index()], needle);
+        } else if (cell.isFormula()) {
+            agg.addValue(cellResult(pos), needle);
+        }
+    });
+    for (const auto& tile : inFile) {
+        forEachFileCell(tile, top, left, bottom, right, [&](const WorkbookImage::Cell& cell) {
+            if (cell.type == NumberCell) {
+                agg.addValue(std::bit_cast<double>(cell.payload), needle);
+            } else if (cell.type == TextCell) {
+                agg.addValue(std::string(m_pagedFile->image->string(cell.payload)), needle);
+            } else {
+                agg.addValue(cellResult(cell.pos), needle);
+            }
+        });
+    }
+
+    return agg.result(fn, h, w, needle);
+}
+
+// Splits the uncached acyclic formulas into levels, each cell only depends on dirty cells of lower levels.
+// A clean cell never depends on a dirty one, so the dependents of a dirty cell are dirty or cyclic.
+std::vector<std::vector<std::pair<int, int>>> CSpreadsheet::dirtyLevels() const {
+    std::unordered_map<std::pair<int, int>, size_t, PosHash> waiting; // dirty precedents not yet leveled
+    m_table.forEach([&](const std::pair<int, int>& pos, CellHandle cell) {
+        if (cell.isFormula() && !m_cache.count(pos) && !m_cyclic.count(pos)) {
+            waiting.emplace(pos, 0);
+        }
+    });
+
+    std::vector<std::vector<std::pair<int, int>>> levels;
+    std::vector<std::pair<int, int>> current;
+    for (auto& [pos, count] : waiting) {
+        forEachPrecedent(pos, [&](const std::pair<int, int>& precedent) {
+            count += waiting.count(precedent);
+        });
+        if (count == 0) {
+            current.push_back(pos);
+        }
+    }
+    while (!current.empty()) {
+        std::vector<std::pair<int, int>> next;
+        for (const auto& pos : current) {
+            forEachDependent(pos, [&](const std::pair<int, int>& dependent) {
+                auto it = waiting.find(dependent);
+                if (it != waiting.end() && --it->second == 0) {
+                    next.push_back(dependent);
+                }
+            });
+        }
+        levels.push_back(std::move(current));
+        current = std::move(next);
+    }
+    return levels;
+}
+
+void CSpreadsheet::publish(unsigned threads) {
+    auto lock = m_background.lock();
+    // Few changed cells are evaluated one by one, which unlike recalculateAll does not scan the whole sheet
+    if (m_publishAll || m_unpublished.size() >= MIN_PARALLEL_CELLS) {
+        recalculate(threads);
+    }
+    if (m_publishAll) {
+        pageInAll();
+        m_values.clear();
+        m_numbers.forEach([&](const std::pair<int, int>& pos, double num) {
+            m_values[pos] = num;
+        });
+        m_table.forEach([&](const std::pair<int, int>& pos, CellHandle) {
+            m_values[pos] = cellResult(pos);
+        });
+        m_publishAll = false;
+    }
+    for (const auto& pos : m_unpublished) {
+        pageIn(pos.first, pos.second, 1, 1);
+        if (m_numbers.find(pos) || m_table.find(pos)) {
+            m_values[pos] = cellResult(pos);
+        } else {
+            m_values.erase(pos);
+        }
+    }
+    m_unpublished.clear();
+    m_published.store(std::make_shared<const CSheetVersion>(m_values, ++m_versionCount));
+    trimTiles();
+}
+
+std::shared_ptr<const CSheetVersion> CSpreadsheet::pin() const {
+    return m_published.load();
+}
+
+void CSpreadsheet::recalculateAll(unsigned threads) {
+    auto lock = m_background.lock();
+    recalculate(threads);
+}
+
+void CSpreadsheet::recalculate(unsigned threads) {
+    // Cells a worker claims at once
+    constexpr size_t CHUNK = 16;
+    // Rows of a filled down formula evaluated together as columns, fewer are not worth the setup
+    constexpr size_t MIN_BLOCK = 8;
+    constexpr size_t MAX_BLOCK = 1024;
+
+    // Workers must not load tiles, and every formula is about to be read anyway
+    pageInAll();
+    std::vector<std::vector<std::pair<int, int>>> levels = dirtyLevels();
+    size_t total = 0;
+    for (const auto& level : levels) {
+        total += level.size();
+    }
+
+    // Results are written into cache entries created up front, so the map never rehashes while
+    // workers read it. A cell only reads cells of lower levels, which are done before its level starts.
+    // Each level is sorted by program and column, so the cells of a formula filled down a column
+    // come out as consecutive rows and are split into blocks, the rest into chunks of single cells.
+    struct Task {
+        size_t begin;
+        size_t count;
+        bool block;
+    };
+    m_cache.reserve(m_cache.size() + total);
+    std::vector<std::vector<std::pair<const ExprProgram*, CValue*>>> slots(levels.size());
+    std::vector<std::vector<Task>> tasks(levels.size());
+    for (size_t l = 0; l < levels.size(); ++l) {
+        auto& level = levels[l];
+        std::vector<std::pair<const ExprProgram*, std::pair<int, int>>> cells;
+        cells.reserve(level.size());
+        for (const auto& pos : level) {
+            cells.emplace_back(programAt(pos)->get(), std::pair<int, int>(pos.second, pos.first));
+        }
+        std::sort(cells.begin(), cells.end());
+        slots[l].reserve(level.size());
+        for (size_t i = 0; i < cells.size(); ++i) {
+            level[i] = {cells[i].second.second, cells[i].second.first};
+            slots[l].emplace_back(cells[i].first, &m_cache[level[i]]);
+        }
+
+        auto addCells = [&](size_t from, size_t to) {
+            while (from < to) {
+                if (tasks[l].empty() || tasks[l].back().block || tasks[l].back().begin + tasks[l].back().count != from
+                    || tasks[l].back().count == CHUNK) {
+                    tasks[l].push_back({from, 0, false});
+                }
+                size_t take = std::min(CHUNK - tasks[l].back().count, to - from);
+                tasks[l].back().count += take;
+                from += take;
+            }
+        };
+        for (size_t i = 0; i < level.size();) {
+            size_t j = i + 1;
+            while (j < level.size() && j - i < MAX_BLOCK && slots[l][j].first == slots[l][i].first
+                   && level[j].second == level[i].second && level[j].first == level[j - 1].first + 1) {
+                j++;
+            }
+            if (j - i >= MIN_BLOCK && slots[l][i].first->columnar()) {
+                tasks[l].push_back({i, j - i, true});
+            } else {
+                addCells(i, j);
+            }
+            i = j;
+        }
+    }
+
+    size_t workers = total < MIN_PARALLEL_CELLS ? 1 : std::max(1u, threads);
+    // Workers read the number index without a lock, so the summaries of the tall ranges are built beforehand
+    if (workers > 1) {
+        std::set<RangeDependents::Range> tall;
+        for (const auto& level : levels) {
+            for (const auto& pos : level) {
+                auto ranges = m_rangePrecedents.find(pos);
+                if (ranges == m_rangePrecedents.end()) {
+                    continue;
+                }
+                for (const auto& range : ranges->second) {
+                    if (range[2] - range[0] + 1 >= ColumnAggregateIndex::MIN_ROWS) {
+                        tall.insert(range);
+                    }
+                }
+            }
+        }
+        for (const auto& [top, left, bottom, right] : tall) {
+            for (int col = left; col <= right; ++col) {
+                m_numberIndex.query(m_numbers, top, bottom, col);
+            }
+        }
+        m_numberIndex.setShared(true);
+    }
+    std::vector<std::atomic<size_t>> claimed(levels.size());
+    std::barrier sync(static_cast<std::ptrdiff_t>(workers));
+    // Workers take tasks of a level from a shared counter, then wait for each other before the next level
+    auto work = [&](std::vector<Operand>& stack) {
+        ColumnLanes lanes;
+        for (size_t l = 0; l < levels.size(); ++l) {
+            for (size_t t = claimed[l].fetch_add(1); t < tasks[l].size(); t = claimed[l].fetch_add(1)) {
+                const Task& task = tasks[l][t];
+                const auto& first = levels[l][task.begin];
+                if (task.block) {
+                    slots[l][task.begin].first->evaluateColumn(*this, first.first, first.second, static_cast<int>(task.count),
+                                                               lanes, stack, [&](size_t k, CValue value) {
+                        *slots[l][task.begin + k].second = std::move(value);
+                    });
+                    continue;
+                }
+                for (size_t i = task.begin; i < task.begin + task.count; ++i) {
+                    const auto& pos = levels[l][i];
+                    *slots[l][i].second = slots[l][i].first->evaluate(*this, pos.first, pos.second, stack);
+                }
+            }
+            sync.arrive_and_wait();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < workers; ++i) {
+        pool.emplace_back([&work] {
+            std::vector<Operand> stack;
+            work(stack);
+        });
+    }
+    work(m_valueStack);
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    m_numberIndex.setShared(false);
+    trimTiles();
+}
+
+void CSpreadsheet::cellChanged(const std::pair<int, int>& pos) {
+    // A value that was not on a cycle has no precedents, so it cannot be on one now either
+    if (!m_cyclic.count(pos) && !programAt(pos)) {
+        unlinkPrecedents(pos);
+        m_numberIndex.invalidate(pos);
+        invalidate(pos);
+        return;
+    }
+    // Only the cycle the cell was on and the one it is on now can change, together they
+    // cover every cell whose cyclic flag may flip.
+    posSet candidates;
+    if (m_cyclic.count(pos)) {
+        candidates = stronglyConnected(pos);
+    }
+    unlinkPrecedents(pos);
+    linkPrecedents(pos);
+    m_numberIndex.invalidate(pos);
+    posSet current = stronglyConnected(pos);
+    candidates.insert(current.begin(), current.end());
+    candidates.insert(pos);
+    markCycles(candidates);
+    invalidate(pos);
+}
+
+void CSpreadsheet::unlinkPrecedents(const std::pair<int, int>& pos) {
+    auto it = m_precedents.find(pos);
+    if (it != m_precedents.end()) {
+        for (const auto& precedent : it->second) {
+            auto dep = m_dependents.find(precedent);
+            if (dep != m_dependents.end()) {
+                dep->second.erase(pos);
+                if (dep->second.empty()) {
+                    m_dependents.erase(dep);
+                }
+            }
+        }
+        m_precedents.erase(it);
+    }
+    auto ranges = m_rangePrecedents.find(pos);
+    if (ranges != m_rangePrecedents.end()) {
+        for (const auto& range : ranges->second) {
+            m_rangeDependents.remove(pos, range);
+        }
+        m_rangePrecedents.erase(ranges);
+    }
+}
+
+void CSpreadsheet::linkPrecedents(const std::pair<int, int>& pos) {
+    if (const auto* program = programAt(pos)) {
+        linkPrecedents(pos, **program);
+    }
+}
+
+void CSpreadsheet::linkPrecedents(const std::pair<int, int>& pos, const ExprProgram& program) const {
+    std::vector<std::pair<int, int>> refs;
+    std::vector<RangeDependents::Range> ranges;
+    program.collectReferences(pos.first, pos.second, refs, ranges);
+    std::sort(refs.begin(), refs.end());
+    refs.erase(std::unique(refs.begin(), refs.end()), refs.end());
+    for (const auto& ref : refs) {
+        m_dependents[ref].insert(pos);
+    }
+    if (!refs.empty()) {
+        m_precedents[pos] = std::move(refs);
+    }
+    std::sort(ranges.begin(), ranges.end());
+    ranges.erase(std::unique(ranges.begin(), ranges.end()), ranges.end());
+    for (const auto& range : ranges) {
+        m_rangeDependents.add(pos, range);
+    }
+    if (!ranges.empty()) {
+        m_rangePrecedents[pos] = std::move(ranges);
+    }
+}
+
+template<typename F>
+void CSpreadsheet::forEachPrecedent(const std::pair<int, int>& pos, F&& fn) const {
+    auto prec = m_precedents.find(pos);
+    if (prec != m_precedents.end()) {
+        std::for_each(prec->second.begin(), prec->second.end(), fn);
+    }
+    auto ranges = m_rangePrecedents.find(pos);
+    if (ranges == m_rangePrecedents.end()) {
+        return;
+    }
+    for (const auto& [top, left, bottom, right] : ranges->second) {
+        // The formulas of tiles still in the file are found there without loading them
+        std::vector<std::pair<int, int>> inFile = fileTiles(top, left, bottom - top + 1, right - left + 1);
+        m_table.forEachInRect(top, left, bottom - top + 1, right - left + 1, [&](const std::pair<int, int>& cell, CellHandle handle) {
+            if (handle.isFormula() && !std::binary_search(inFile.begin(), inFile.end(), WorkbookImage::tileOf(cell))) {
+                fn(cell);
+            }
+        });
+        for (const auto& tile : inFile) {
+            forEachFileCell(tile, top, left, bottom, right, [&](const WorkbookImage::Cell& cell) {
+                if (cell.type == FormulaCell) {
+                    fn(cell.pos);
+                }
+            });
+        }
+    }
+}
+
+template<typename F>
+void CSpreadsheet::forEachDependent(const std::pair<int, int>& pos, F&& fn) const {
+    auto dep = m_dependents.find(pos);
+    if (dep != m_dependents.end()) {
+        std::for_each(dep->second.begin(), dep->second.end(), fn);
+    }
+    m_rangeDependents.forEachCovering(pos, fn);
+}
+
+bool CSpreadsheet::refersToItself(const std::pair<int, int>& pos) const {
+    auto prec = m_precedents.find(pos);
+    if (prec != m_precedents.end() && std::binary_search(prec->second.begin(), prec->second.end(), pos)) {
+        return true;
+    }
+    auto ranges = m_rangePrecedents.find(pos);
+    return ranges != m_rangePrecedents.end()
+           && std::any_of(ranges->second.begin(), ranges->second.end(), [&](const RangeDependents::Range& range) {
+               return range[0] <= pos.first && pos.first <= range[2] && range[1] <= pos.second && pos.second <= range[3];
+           });
+}
+
+// Marks the cell and its transitive dependents dirty. Cyclic cells are never cached,
+// so the walk passes through them instead of stopping.
+void CSpreadsheet::invalidate(const std::pair<int, int>& pos) {
+    m_cache.erase(pos);
+    // Every cell reached below is either clean or cyclic, all the others were collected when they became dirty
+    auto unpublished = [&](const std::pair<int, int>& cell) {
+        if (!m_publishAll) {
+            m_unpublished.insert(cell);
+        }
+        if (m_background.running()) {
+            m_background.dirty.push_back(cell);
+            m_background.wake.notify_one();
+        }
+        if (!m_subscriptions.subscriptions.empty() && m_subscriptions.watches.find(cell)) {
+            m_subscriptions.pending.push_back(cell);
+        }
+    };
+    unpublished(pos);
+    posSet visitedCyclic;
+    std::vector<std::pair<int, int>> pending = {pos};
+    while (!pending.empty()) {
+        auto current = pending.back();
+        pending.pop_back();
+        forEachDependent(current, [&](const std::pair<int, int>& dependent) {
+            if (m_cache.erase(dependent)
+                || (m_cyclic.count(dependent) && visitedCyclic.insert(dependent).second)) {
+                unpublished(dependent);
+                pending.push_back(dependent);
+            }
+        });
+    }
+}
+
+// Returns the cells on a common cycle with pos: those reachable from it that can also reach it back.
+CSpreadsheet::posSet CSpreadsheet::stronglyConnected(const std::pair<int, int>& pos) const {
+    posSet result = connecting({pos});
+    if (result.size() == 1 && !refersToItself(pos)) {
+        result.clear();
+    }
+    return result;
+}
+
+// Returns the cells on a path from one of the sources to one of them, which includes every cycle through a source.
+// A cell on such a path shares it with its whole cycle, so the result never splits a cycle.
+// The cells the sources reach and the cells reaching them are collected in turns until one of the two runs out,
+// the result is then what the other direction reaches inside it. An edit far down a long chain thus costs as
+// much as the short side of it, not the whole cone above or below.
+CSpreadsheet::posSet CSpreadsheet::connecting(const std::vector<std::pair<int, int>>& sources) const {
+    struct Walk {
+        posSet seen;
+        std::vector<std::pair<int, int>> pending;
+        bool forward;
+    };
+    // Takes one cell off the walk and adds its unseen neighbours, only those in within when it is given
+    auto step = [&](Walk& walk, const posSet* within) {
+        auto current = walk.pending.back();
+        walk.pending.pop_back();
+        auto visit = [&](const std::pair<int, int>& next) {
+            if ((!within || within->count(next)) && walk.seen.insert(next).second) {
+                walk.pending.push_back(next);
+            }
+        };
+        if (walk.forward) {
+            forEachDependent(current, visit);
+        } else {
+            forEachPrecedent(current, visit);
+        }
+    };
+    auto start = [&](bool forward) {
+        return Walk{posSet(sources.begin(), sources.end()), sources, forward};
+    };
+
+    Walk walks[2] = {start(true), start(false)};
+    size_t turn = 0;
+    while (!walks[0].pending.empty() && !walks[1].pending.empty()) {
+        step(walks[turn], nullptr);
+        turn ^= 1;
+    }
+    const Walk& complete = walks[0].pending.empty() ? walks[0] : walks[1];
+    Walk inside = start(!complete.forward);
+    while (!inside.pending.empty()) {
+        step(inside, &complete.seen);
+    }
+    return std::move(inside.seen);
+}
+
+// Runs Tarjan's algorithm on the subgraph induced by nodes and updates their cyclic flags.
+// A node is cyclic when its component has more than one cell or it refers to itself.
+void CSpreadsheet::markCycles(const posSet& nodes) {
+    struct Frame {
+        std::pair<int, int> pos;
+        // Precedents among nodes, collected when the frame is entered
+        std::vector<std::pair<int, int>> precedents;
+        size_t next;
+    };
+    std::unordered_map<std::pair<int, int>, std::pair<size_t, size_t>, PosHash> index; // index, lowlink
+    posSet onStack;
+    std::vector<std::pair<int, int>> sccStack;
+    std::vector<Frame> callStack;
+    size_t counter = 0;
+
+    auto enter = [&](const std::pair<int, int>& pos) {
+        index[pos] = {counter, counter};
+        counter++;
+        sccStack.push_back(pos);
+        onStack.insert(pos);
+        callStack.push_back({pos, {}, 0});
+        forEachPrecedent(pos, [&](const std::pair<int, int>& precedent) {
+            if (nodes.count(precedent)) {
+                callStack.back().precedents.push_back(precedent);
+            }
+        });
+    };
+    auto setCyclic = [&](const std::pair<int, int>& pos, bool cyclic) {
+        bool changed = cyclic ? m_cyclic.insert(pos).second : m_cyclic.erase(pos) > 0;
+        if (changed) {
+            invalidate(pos);
+        }
+    };
+
+    for (const auto& root : nodes) {
+        if (index.count(root)) {
+            continue;
+        }
+        enter(root);
+
+        while (!callStack.empty()) {
+            Frame& frame = callStack.back();
+            if (frame.next < frame.precedents.size()) {
+                std::pair<int, int> next = frame.precedents[frame.next++];
+                auto found = index.find(next);
+                if (found == index.end()) {
+                    enter(next);
+                } else if (onStack.count(next)) {
+                    auto& low = index[frame.pos].second;
+                    low = std::min(low, found->second.first);
+                }
+                continue;
+            }
+
+            std::pair<int, int> pos = frame.pos;
+            bool selfReference = std::find(frame.precedents.begin(), frame.precedents.end(), pos) != frame.precedents.end();
+            callStack.pop_back();
+            auto [posIndex, posLow] = index[pos];
+            if (!callStack.empty()) {
+                auto& parentLow = index[callStack.back().pos].second;
+                parentLow = std::min(parentLow, posLow);
+            }
+            if (posIndex != posLow) {
+                continue;
+            }
+
+            // pos is the root of a component, pop it off the stack
+            std::vector<std::pair<int, int>> component;
+            std::pair<int, int> member;
+            do {
+                member = sccStack.back();
+                sccStack.pop_back();
+                onStack.erase(member);
+                component.push_back(member);
+            } while (member != pos);
+
+            bool cyclic = component.size() > 1 || selfReference;
+            for (const auto& cell : component) {
+                setCyclic(cell, cyclic);
+            }
+        }
+    }
+}
+
+void CSpreadsheet::rebuildDependencies() {
+    m_cache.clear();
+    m_unpublished.clear();
+    m_publishAll = true;
+    m_background.reseed = true;
+    m_background.wake.notify_one();
+    m_subscriptions.all = true;
+    m_precedents.clear();
+    m_dependents.clear();
+    m_rangePrecedents.clear();
+    m_rangeDependents.clear();
+    m_cyclic.clear();
+    posSet formulas;
+    m_table.forEach([&](const std::pair<int, int>& pos, CellHandle cell) {
+        if (cell.isFormula()) {
+            linkPrecedents(pos);
+            formulas.insert(pos);
+        }
+    });
+    markCycles(formulas);
+}
+
+void CSpreadsheet::clear() {
+    m_numbers.clear();
+    m_table.clear();
+    m_texts.clear();
+    m_programs.clear();
+    m_numberIndex.clear();
+    m_formulaArena.reset();
+    m_templates.clear();
+    m_cache.clear();
+    m_precedents.clear();
+    m_dependents.clear();
+    m_rangePrecedents.clear();
+    m_rangeDependents.clear();
+    m_cyclic.clear();
+    m_values.clear();
+    m_unpublished.clear();
+    m_publishAll = true;
+    m_background.reseed = true;
+    m_background.wake.notify_one();
+    m_subscriptions.all = true;
+    m_pagedFile.reset();
+    m_pagedOut.clear();
+    m_unlinked.clear();
+    m_cleanTiles.clear();
+    m_maxTiles = 0;
+}
+
+// Loads the tiles of an opened workbook that overlap the h x w rectangle at (row, col).
+void CSpreadsheet::pageIn(int row, int col, int h, int w) const {
+    for (const auto& tile : fileTiles(row, col, h, w)) {
+        pageInTile(tile);
+    }
+}
+
+void CSpreadsheet::pageInTile(const std::pair<int, int>& tile) const {
+    if (!linkTile(tile)) {
+        return;
+    }
+    const WorkbookImage& image = *m_pagedFile->image;
+    WorkbookImage::Tile found = image.tile(image.tileLowerBound(tile));
+    for (uint32_t i = found.first; i < found.first + found.count; ++i) {
+        WorkbookImage::Cell cell = image.cell(i);
+        if (cell.type == NumberCell) {
+            m_numbers[cell.pos] = std::bit_cast<double>(cell.payload);
+        } else if (cell.type == TextCell) {
+            m_table[cell.pos] = encode(std::string(image.string(cell.payload)));
+        } else {
+            m_table[cell.pos] = encode(m_pagedFile->program(cell.payload));
+        }
+    }
+    m_pagedOut.erase(tile);
+    m_cleanTiles.touch(tile);
+}
+
+void CSpreadsheet::pageInAll() const {
+    std::vector<std::pair<int, int>> tiles(m_pagedOut.begin(), m_pagedOut.end());
+    for (const auto& tile : tiles) {
+        pageInTile(tile);
+    }
+}
+
+// Returns the tiles overlapping the h x w rectangle at (row, col) that are still in the file, sorted and checked.
+// The loaded ones count as used.
+std::vector<std::pair<int, int>> CSpreadsheet::fileTiles(int row, int col, int h, int w) const {
+    std::vector<std::pair<int, int>> tiles;
+    if (m_pagedOut.empty() || h <= 0 || w <= 0) {
+        return tiles;
+    }
+    auto [firstRow, firstCol] = WorkbookImage::tileOf({row, col});
+    auto [lastRow, lastCol] = WorkbookImage::tileOf({row + h - 1, col + w - 1});
+    // Large ranges check the few tiles left in the file instead of every tile they cover
+    if (static_cast<double>(lastRow - firstRow + 1) * (lastCol - firstCol + 1) > static_cast<double>(m_pagedOut.size())) {
+        for (const auto& tile : m_pagedOut) {
+            if (tile.first >= firstRow && tile.first <= lastRow && tile.second >= firstCol && tile.second <= lastCol) {
+                tiles.push_back(tile);
+            }
+        }
+    } else {
+        for (int tileRow = firstRow; tileRow <= lastRow; ++tileRow) {
+            for (int tileCol = firstCol; tileCol <= lastCol; ++tileCol) {
+                if (m_pagedOut.count({tileRow, tileCol})) {
+                    tiles.emplace_back(tileRow, tileCol);
+                } else {
+                    m_cleanTiles.refresh({tileRow, tileCol});
+                }
+            }
+        }
+    }
+    std::erase_if(tiles, [&](const std::pair<int, int>& tile) {
+        return !linkTile(tile);
+    });
+    std::sort(tiles.begin(), tiles.end());
+    return tiles;
+}
+
+// Calls fn with the records of the cells of the range stored in a tile of the file, whether it is loaded or not.
+template<typename F>
+void CSpreadsheet::forEachFileCell(const std::pair<int, int>& tile, int top, int left, int bottom, int right, F&& fn) const {
+    const WorkbookImage& image = *m_pagedFile->image;
+    WorkbookImage::Tile found = image.tile(image.tileLowerBound(tile));
+    int fromRow = std::max(top, tile.first << WORKBOOK_TILE_BITS);
+    int toRow = std::min(bottom, (tile.first << WORKBOOK_TILE_BITS) + (1 << WORKBOOK_TILE_BITS) - 1);
+    uint32_t end = found.first + found.count;
+    for (int row = fromRow; row <= toRow; ++row) {
+        for (uint32_t at = image.lowerBound(found, {row, left}); at < end; ++at) {
+            WorkbookImage::Cell cell = image.cell(at);
+            if (cell.pos.first != row || cell.pos.second > right) {
+                break;
+            }
+            fn(cell);
+        }
+    }
+}
+
+// Checks a tile of the file the first time it is read and links its formulas, their cycle flags were computed
+// by the sheet that saved them. A damaged tile is dropped from the file and reads as empty, false is returned.
+bool CSpreadsheet::linkTile(const std::pair<int, int>& tile) const {
+    if (!m_unlinked.erase(tile)) {
+        return true;
+    }
+    const WorkbookImage& image = *m_pagedFile->image;
+    std::vector<std::pair<WorkbookImage::Cell, std::shared_ptr<ExprProgram>>> formulas;
+    try {
+        WorkbookImage::Tile found = image.tile(image.tileLowerBound(tile));
+        if (!image.tileValid(found)) {
+            throw std::runtime_error("Damaged tile");
+        }
+        for (uint32_t i = found.first; i < found.first + found.count; ++i) {
+            WorkbookImage::Cell cell = image.cell(i);
+            if (cell.type == TextCell) {
+                image.string(cell.payload);
+            } else if (cell.type == FormulaCell) {
+                formulas.emplace_back(cell, m_pagedFile->program(cell.payload));
+            }
+        }
+    } catch (...) {
+        m_pagedOut.erase(tile);
+        return false;
+    }
+    for (const auto& [cell, program] : formulas) {
+        linkPrecedents(cell.pos, *program);
+        if (cell.cyclic) {
+            m_cyclic.insert(cell.pos);
+        }
+    }
+    return true;
+}
+
+// Links every tile not read yet. An edit calls it first, invalidation and cycle detection follow references
+// through the whole sheet. The flags of the file stay valid until then, as nothing has changed.
+void CSpreadsheet::linkAll() const {
+    std::vector<std::pair<int, int>> tiles(m_unlinked.begin(), m_unlinked.end());
+    for (const auto& tile : tiles) {
+        linkTile(tile);
+    }
+}
+
+// A modified tile differs from the file, so it is never dropped.
+void CSpreadsheet::tileModified(const std::pair<int, int>& tile) {
+    m_cleanTiles.erase(tile);
+}
+
+// Drops the least recently used unmodified tiles above the budget. Called once a public operation is done,
+// never during evaluation, which may hold references into any loaded tile. Cached results and the
+// aggregate index summaries stay valid because the dropped cells are unchanged in the file.
+void CSpreadsheet::trimTiles() {
+    while (m_cleanTiles.size() > m_maxTiles) {
+        std::pair<int, int> tile = m_cleanTiles.popOldest();
+        int row = tile.first << WORKBOOK_TILE_BITS;
+        int col = tile.second << WORKBOOK_TILE_BITS;
+        m_numbers.eraseRect(row, col, 1 << WORKBOOK_TILE_BITS, 1 << WORKBOOK_TILE_BITS);
+        eraseCells(row, col, 1 << WORKBOOK_TILE_BITS, 1 << WORKBOOK_TILE_BITS);
+        m_pagedOut.insert(tile);
+    }
+}
+
+#include "snapshot.h"
+
 #ifndef __PROGTEST__
 
 
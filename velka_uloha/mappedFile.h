@@ -0,0 +1,64 @@
+//
+// Read-only memory mapping of a whole file.
+//
+
+#ifndef VELKA_ULOHA_MAPPEDFILE_H
+#define VELKA_ULOHA_MAPPEDFILE_H
+
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The pages are shared with every other process mapping the same file and are read from disk on first access.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        close();
+    }
+
+    // Returns false if the file cannot be opened, is empty or cannot be mapped.
+    bool open(const std::string& fileName) {
+        close();
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        void* map = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd); // The mapping stays valid without the descriptor
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        m_map = static_cast<const char*>(map);
+        m_size = static_cast<size_t>(info.st_size);
+        return true;
+    }
+
+    void close() {
+        if (m_map) {
+            munmap(const_cast<char*>(m_map), m_size);
+            m_map = nullptr;
+            m_size = 0;
+        }
+    }
+
+    std::string_view data() const {
+        return {m_map, m_size};
+    }
+
+private:
+    const char* m_map = nullptr;
+    size_t m_size = 0;
+};
+
+#endif //VELKA_ULOHA_MAPPEDFILE_H
@@ -0,0 +1,125 @@
+//
+// Index of the ranges formulas refer to, finds the formulas depending on a cell through a range.
+//
+
+#ifndef VELKA_ULOHA_RANGEINDEX_H
+#define VELKA_ULOHA_RANGEINDEX_H
+
+#include <algorithm>
+#include <array>
+#include <map>
+#include <unordered_map>
+#include <utility>
+
+// A range is kept as intervals along its shorter side: a tall range as an interval of rows in each of its
+// columns, a wide one as an interval of columns in each of its rows. A formula over A1:A1000000 is then
+// a single entry instead of an edge per cell. Looking up the ranges over a cell only visits the intervals
+// of its column and row that start close enough before it to reach it.
+class RangeDependents {
+public:
+    // Top, left, bottom and right, as RangeOperand::bounds returns them
+    using Range = std::array<int, 4>;
+
+    void add(const std::pair<int, int>& dependent, const Range& range) {
+        auto [top, left, bottom, right] = range;
+        if (bottom - top >= right - left) {
+            for (int col = left; col <= right; ++col) {
+                m_columns.add(col, top, bottom, dependent);
+            }
+        } else {
+            for (int row = top; row <= bottom; ++row) {
+                m_rows.add(row, left, right, dependent);
+            }
+        }
+    }
+
+    // Removes an entry made by add with the same arguments.
+    void remove(const std::pair<int, int>& dependent, const Range& range) {
+        auto [top, left, bottom, right] = range;
+        if (bottom - top >= right - left) {
+            for (int col = left; col <= right; ++col) {
+                m_columns.remove(col, top, bottom, dependent);
+            }
+        } else {
+            for (int row = top; row <= bottom; ++row) {
+                m_rows.remove(row, left, right, dependent);
+            }
+        }
+    }
+
+    // Calls fn(dependent) once for each range added that covers pos.
+    template<typename F>
+    void forEachCovering(const std::pair<int, int>& pos, F&& fn) const {
+        m_columns.forEachCovering(pos.second, pos.first, fn);
+        m_rows.forEachCovering(pos.first, pos.second, fn);
+    }
+
+    void clear() {
+        m_columns.clear();
+        m_rows.clear();
+    }
+
+private:
+    // Intervals of the lines, either columns or rows, ordered by where they start
+    class Lines {
+    public:
+        void add(int line, int from, int to, const std::pair<int, int>& dependent) {
+            Line& entry = m_lines[line];
+            entry.intervals.emplace(from, Interval{to, dependent});
+            entry.longest = std::max(entry.longest, to - from);
+        }
+
+        void remove(int line, int from, int to, const std::pair<int, int>& dependent) {
+            auto it = m_lines.find(line);
+            if (it == m_lines.end()) {
+                return;
+            }
+            auto [first, last] = it->second.intervals.equal_range(from);
+            for (auto interval = first; interval != last; ++interval) {
+                if (interval->second.to == to && interval->second.dependent == dependent) {
+                    it->second.intervals.erase(interval);
+                    break;
+                }
+            }
+            // The longest interval is only forgotten with the line, until then it merely widens the lookups
+            if (it->second.intervals.empty()) {
+                m_lines.erase(it);
+            }
+        }
+
+        template<typename F>
+        void forEachCovering(int line, int at, F& fn) const {
+            auto it = m_lines.find(line);
+            if (it == m_lines.end()) {
+                return;
+            }
+            const Line& entry = it->second;
+            auto end = entry.intervals.upper_bound(at);
+            for (auto interval = entry.intervals.lower_bound(at - entry.longest); interval != end; ++interval) {
+                if (interval->second.to >= at) {
+                    fn(interval->second.dependent);
+                }
+            }
+        }
+
+        void clear() {
+            m_lines.clear();
+        }
+
+    private:
+        struct Interval {
+            int to;
+            std::pair<int, int> dependent;
+        };
+        struct Line {
+            std::multimap<int, Interval> intervals;
+            int longest = 0;
+        };
+        std::unordered_map<int, Line> m_lines;
+    };
+
+    Lines m_columns;
+    Lines m_rows;
+};
+
+#endif //VELKA_ULOHA_RANGEINDEX_H
@@ -0,0 +1,247 @@
+//
+// Read-only view of a saved workbook served straight from a memory mapped file.
+//
+
+#ifndef VELKA_ULOHA_SNAPSHOT_H
+#define VELKA_ULOHA_SNAPSHOT_H
+
+#include "mappedFile.h"
+
+// Opening only checks the header, cells are decoded from the mapping when they are read and formulas
+// are evaluated on first use. The checksum is not verified, which would read the whole file, but every
+// access is bounds checked. The pages are shared with every other process mapping the same file.
+// Like CSpreadsheet, a snapshot must not be read from several threads at once.
+class CSnapshot {
+public:
+    CSnapshot() = default;
+    CSnapshot(const CSnapshot&) = delete;
+    CSnapshot& operator=(const CSnapshot&) = delete;
+    ~CSnapshot() {
+        close();
+    }
+
+    // Maps a file written by CSpreadsheet::save, returns false if it cannot be mapped or is not a workbook.
+    bool open(const std::string& fileName) {
+        close();
+        if (!m_file.open(fileName)) {
+            return false;
+        }
+        try {
+            m_image.emplace(m_file.data());
+        } catch (...) {
+            close();
+            return false;
+        }
+        m_arena = std::make_shared<std::pmr::monotonic_buffer_resource>();
+        return true;
+    }
+
+    CValue getValue(CPos pos) {
+        try {
+            return cellResult(pos.cPosHW);
+        } catch (...) {
+            return CValue(); // Malformed cell or formula in the file
+        }
+    }
+
+    CValue cellResult(const std::pair<int, int>& pos) const {
+        if (!m_image) {
+            return CValue();
+        }
+        std::optional<WorkbookImage::Cell> cell = m_image->findCell(pos);
+        if (!cell) {
+            return CValue();
+        }
+        return cellValue(*cell);
+    }
+
+    // Texts are viewed in the mapping, which stays until the snapshot is closed.
+    Operand cellOperand(const std::pair<int, int>& pos) const {
+        std::optional<WorkbookImage::Cell> cell = m_image ? m_image->findCell(pos) : std::nullopt;
+        if (cell && cell->type == TextCell) {
+            return m_image->string(cell->payload);
+        }
+        return toOperand(cellResult(pos));
+    }
+
+    CValue aggregateRange(OpCode fn, int top, int left, int bottom, int right, const CValue& needle) const {
+        RangeAggregate agg;
+        forEachCell(top, left, bottom, right, [&](const WorkbookImage::Cell& cell) {
+            agg.addValue(cellValue(cell), needle);
+        });
+        return agg.result(fn, bottom - top + 1, right - left + 1, needle);
+    }
+
+    // Operand stack of the formula interpreter, kept allocated between evaluations.
+    mutable std::vector<Operand> m_valueStack;
+
+private:
+    // Calls fn with each stored cell of the range. Walks the directory over the tile rows in range, jumping
+    // over the tiles left or right of it, and searches for the start of each row's span inside a tile.
+    template<typename Fn>
+    void forEachCell(int top, int left, int bottom, int right, Fn fn) const {
+        std::pair<int, int> firstTile = WorkbookImage::tileOf({top, left});
+        std::pair<int, int> lastTile = WorkbookImage::tileOf({bottom, right});
+        uint32_t index = m_image->tileLowerBound(firstTile);
+        while (index < m_image->tileCount()) {
+            WorkbookImage::Tile tile = m_image->tile(index);
+            if (tile.pos.first > lastTile.first) {
+                break;
+            }
+            if (tile.pos.second < firstTile.second) {
+                index = m_image->tileLowerBound({tile.pos.first, firstTile.second});
+                continue;
+            } else if (tile.pos.second > lastTile.second) {
+                index = m_image->tileLowerBound({tile.pos.first + 1, firstTile.second});
+                continue;
+            }
+            int fromRow = std::max(top, tile.pos.first << WORKBOOK_TILE_BITS);
+            int toRow = std::min(bottom, (tile.pos.first << WORKBOOK_TILE_BITS) + (1 << WORKBOOK_TILE_BITS) - 1);
+            uint32_t end = tile.first + tile.count;
+            for (int row = fromRow; row <= toRow; ++row) {
+                for (uint32_t at = m_image->lowerBound(tile, {row, left}); at < end; ++at) {
+                    WorkbookImage::Cell cell = m_image->cell(at);
+                    if (cell.pos.first != row || cell.pos.second > right) {
+                        break;
+                    }
+                    fn(cell);
+                }
+            }
+            index++;
+        }
+    }
+
+    const ExprProgram& programOf(const WorkbookImage::Cell& cell) const {
+        auto& program = m_programs[cell.payload];
+        if (!program) {
+            program = m_image->program(cell.payload, m_arena);
+        }
+        return *program;
+    }
+
+    // Formulas the cell refers to, directly or through a range, whose result is not known yet
+    // and that are not being evaluated already.
+    void dirtyPrecedents(const WorkbookImage::Cell& cell, std::vector<WorkbookImage::Cell>& out) const {
+        auto add = [&](const WorkbookImage::Cell& precedent) {
+            if (precedent.type == FormulaCell && !precedent.cyclic && !m_cache.count(precedent.pos)
+                && !m_evaluating.count(precedent.pos)) {
+                out.push_back(precedent);
+            }
+        };
+        const ExprProgram& program = programOf(cell);
+        for (const Instruction& ins : program.code) {
+            if (ins.op == OpCode::PushRef) {
+                if (std::optional<WorkbookImage::Cell> precedent = m_image->findCell(ins.position(cell.pos.first, cell.pos.second))) {
+                    add(*precedent);
+                }
+            } else if (ins.op >= OpCode::Sum && ins.op <= OpCode::CountVal) {
+                auto [top, left, bottom, right] = program.ranges[ins.rangeIndex].bounds(cell.pos.first, cell.pos.second);
+                forEachCell(top, left, bottom, right, add);
+            }
+        }
+    }
+
+    // Same as CSpreadsheet::evaluatePrecedents: evaluates the formulas the cell depends on in post order on
+    // an explicit stack, so each of them reads cached results only. Cells on the stack are kept in
+    // m_evaluating, a cycle the flags missed is then cut like in cellValue.
+    void evaluatePrecedents(const WorkbookImage::Cell& cell) const {
+        struct Frame {
+            WorkbookImage::Cell cell;
+            std::vector<WorkbookImage::Cell> precedents;
+            size_t next;
+        };
+        std::vector<Frame> callStack;
+        auto push = [&](const WorkbookImage::Cell& next) {
+            callStack.push_back({next, {}, 0});
+            dirtyPrecedents(next, callStack.back().precedents);
+        };
+        try {
+            push(cell);
+            while (!callStack.empty()) {
+                Frame& frame = callStack.back();
+                if (frame.next < frame.precedents.size()) {
+                    WorkbookImage::Cell next = frame.precedents[frame.next++];
+                    if (!m_cache.count(next.pos) && m_evaluating.insert(next.pos).second) {
+                        push(next);
+                    }
+                    continue;
+                }
+                WorkbookImage::Cell done = frame.cell;
+                callStack.pop_back();
+                if (!callStack.empty()) {
+                    m_evaluating.erase(done.pos);
+                    cellValue(done);
+                }
+            }
+        } catch (...) {
+            for (size_t i = 1; i < callStack.size(); ++i) {
+                m_evaluating.erase(callStack[i].cell.pos);
+            }
+            throw;
+        }
+    }
+
+    CValue cellValue(const WorkbookImage::Cell& cell) const {
+        switch (cell.type) {
+            case NumberCell:
+                return std::bit_cast<double>(cell.payload);
+            case TextCell:
+                return std::string(m_image->string(cell.payload));
+            case FormulaCell:
+                break;
+            default:
+                throw std::runtime_error("Unknown cell type");
+        }
+        // Cycles were found by the sheet that saved the file
+        if (cell.cyclic) {
+            return CValue();
+        }
+        auto cached = m_cache.find(cell.pos);
+        if (cached != m_cache.end()) {
+            return cached->second;
+        }
+        // A cycle the flags missed can only come from a damaged file, it reads as empty
+        if (!m_evaluating.insert(cell.pos).second) {
+            return CValue();
+        }
+        // Each reference to an uncached formula nests another evaluation, past a few levels the rest of
+        // the chain is evaluated from its far end instead
+        CValue result;
+        m_evaluationDepth++;
+        try {
+            if (m_evaluationDepth > MAX_NESTED_EVALUATIONS) {
+                evaluatePrecedents(cell);
+            }
+            result = programOf(cell).evaluate(*this, cell.pos.first, cell.pos.second);
+        } catch (...) {
+            m_evaluationDepth--;
+            m_evaluating.erase(cell.pos);
+            throw;
+        }
+        m_evaluationDepth--;
+        m_evaluating.erase(cell.pos);
+        m_cache.emplace(cell.pos, result);
+        return result;
+    }
+
+    void close() {
+        m_image.reset();
+        m_programs.clear();
+        m_cache.clear();
+        m_evaluating.clear();
+        m_evaluationDepth = 0;
+        m_file.close();
+    }
+
+    MappedFile m_file;
+    std::optional<WorkbookImage> m_image;
+    std::shared_ptr<std::pmr::memory_resource> m_arena;
+    // Programs decoded so far by their index in the file
+    mutable std::unordered_map<uint64_t, std::shared_ptr<ExprProgram>> m_programs;
+    mutable std::unordered_map<std::pair<int, int>, CValue, PosHash> m_cache;
+    mutable std::unordered_set<std::pair<int, int>, PosHash> m_evaluating;
+    mutable size_t m_evaluationDepth = 0;
+    static constexpr size_t MAX_NESTED_EVALUATIONS = 64;
+};
+
+#endif //VELKA_ULOHA_SNAPSHOT_H
@@ -127,7 +127,9 @@ void generateTableWithCycles() {
 
 #define SIMPLE_TESTS // Simple tests - getVal, save & load - no file corruption.
 #define CYCLIC_DEPS_TESTS // Cycle generation, if time > 2s -> exception
-//#define FILE_IO_TESTS // file corruption tests.
+#define FILE_IO_TESTS // file corruption tests.
+#define FUNCTIONS_TESTS // Range functions and if, also across copyRect and save & load.
+#define RECALC_TESTS // Parallel recalculation has to give exactly the values of lazy evaluation.
 #include <future>
 #include <chrono>
 
@@ -252,6 +254,248 @@ void runTests(){
     assert(valueMatch(preTests.getValue(CPos("k3")), CValue()));
     assert(valueMatch(preTests.getValue(CPos("k4")), CValue()));
     assert(valueMatch(preTests.getValue(CPos("k5")), CValue()));
+
+    CSpreadsheet operators;
+    setCellRange({"a1", "a2", "b1", "b2"}, {"1", "2", "=a1<>a2", "=a1<a2"}, operators);
+    copyRectRange({{"c1", "b1"}}, 2, 1, operators);
+    assert(valueMatch(operators.getValue(CPos("b1")), CValue(1.)));
+    assert(valueMatch(operators.getValue(CPos("c1")), CValue(0.)));
+    assert(valueMatch(operators.getValue(CPos("c2")), CValue(0.)));
+
+    // Every level reads the previous one twice, each cell must still be evaluated only once per read.
+    CSpreadsheet diamond;
+    diamond.setCell(CPos("B0"), "1");
+    for(int j = 1; j <= 60; j++){
+        diamond.setCell(CPos("B" + std::to_string(j)), "=B" + std::to_string(j - 1) + "+$B" + std::to_string(j - 1));
+    }
+    assert(valueMatch(diamond.getValue(CPos("B60")), CValue(std::ldexp(1., 60))));
+    diamond.setCell(CPos("B0"), "2");
+    assert(valueMatch(diamond.getValue(CPos("B60")), CValue(std::ldexp(1., 61))));
+
+    // Cached results are dropped by every edit below them: values, formulas, texts, copies and clears.
+    CSpreadsheet stale;
+    setCellRange({"A1", "B1", "C1", "D1", "E1"}, {"1", "=A1*2", "=B1+A1", "=C1+B1", "7"}, stale);
+    assert(valueMatch(stale.getValue(CPos("D1")), CValue(5.)));
+    stale.setCell(CPos("A1"), "5");
+    assert(valueMatch(stale.getValue(CPos("C1")), CValue(15.)));
+    assert(valueMatch(stale.getValue(CPos("D1")), CValue(25.)));
+    stale.setCell(CPos("B1"), "=A1*3");
+    assert(valueMatch(stale.getValue(CPos("D1")), CValue(35.)));
+    stale.setCell(CPos("B1"), "x");
+    assert(valueMatch(stale.getValue(CPos("C1")), CValue("x5.000000")));
+    assert(valueMatch(stale.getValue(CPos("D1")), CValue("x5.000000x")));
+    stale.copyRect(CPos("B1"), CPos("E1"), 1, 1);
+    assert(valueMatch(stale.getValue(CPos("D1")), CValue(19.)));
+    stale.copyRect(CPos("A1"), CPos("F1"), 1, 1);
+    assert(valueMatch(stale.getValue(CPos("C1")), CValue()));
+    assert(valueMatch(stale.getValue(CPos("D1")), CValue()));
+    stale.setCell(CPos("A1"), "1");
+    assert(valueMatch(stale.getValue(CPos("D1")), CValue(15.)));
+    // A copied formula closing a cycle empties the cells on it
+    stale.setCell(CPos("E1"), "=G1");
+    stale.copyRect(CPos("B1"), CPos("E1"), 1, 1);
+    assert(valueMatch(stale.getValue(CPos("D1")), CValue()));
+    stale.setCell(CPos("A1"), "2");
+    assert(valueMatch(stale.getValue(CPos("C1")), CValue()));
+    assert(valueMatch(stale.getValue(CPos("D1")), CValue()));
+    stale.setCell(CPos("B1"), "=A1*2");
+    assert(valueMatch(stale.getValue(CPos("D1")), CValue(10.)));
+
+    // Cells on both sides of the 64 x 64 tile edges, written, summed and copied across them.
+    CSpreadsheet edges;
+    for(int row = 62; row < 66; row++){
+        for(int col = 62; col < 66; col++){
+            edges.setCell(CPos(row, col), std::to_string(row * 100 + col));
+        }
+    }
+    edges.setCell(CPos("A1"), "=sum(BK62:BN65)");
+    edges.setCell(CPos("A2"), "=BL63+BM64");
+    assert(valueMatch(edges.getValue(CPos("A1")), CValue(102616.)));
+    edges.copyRect(CPos(126, 126), CPos(62, 62), 4, 4);
+    assert(valueMatch(edges.getValue(CPos(129, 129)), CValue(6565.)));
+    assert(valueMatch(edges.getValue(CPos(127, 128)), CValue(6364.)));
+    // Overlapping source and destination read the source as it was before the copy
+    edges.copyRect(CPos(63, 63), CPos(62, 62), 4, 4);
+    assert(valueMatch(edges.getValue(CPos(63, 63)), CValue(6262.)));
+    assert(valueMatch(edges.getValue(CPos(64, 64)), CValue(6363.)));
+    assert(valueMatch(edges.getValue(CPos(66, 66)), CValue(6565.)));
+    assert(valueMatch(edges.getValue(CPos(62, 65)), CValue(6265.)));
+    assert(valueMatch(edges.getValue(CPos("A1")), CValue(102616. - 9 * 101)));
+    assert(valueMatch(edges.getValue(CPos("A2")), CValue(6262. + 6363)));
+    edges.copyRect(CPos("B2"), CPos("A2"), 1, 1);
+    assert(valueMatch(edges.getValue(CPos("B2")), CValue(6263. + 6364)));
+    saveLoad(edges);
+    assert(valueMatch(edges.getValue(CPos(129, 129)), CValue(6565.)));
+    assert(valueMatch(edges.getValue(CPos("B2")), CValue(6263. + 6364)));
+
+    // Column names of four letters and more, ZZZ is the column right before AAAA.
+    CSpreadsheet wide;
+    assert(CPos("AAAA9999").cPosHW == std::make_pair(9999, 18278));
+    assert(CPos("zzz1").cPosHW == std::make_pair(1, 18277));
+    setCellRange({"AAAA9999", "ZZZ10000", "AAAB1"}, {"5", "=AAAA9999*2+$AAAB$1", "1"}, wide);
+    assert(valueMatch(wide.getValue(CPos("ZZZ10000")), CValue(11.)));
+    wide.setCell(CPos("AAAA10000"), "=sum(ZZZ9999:AAAA9999)");
+    wide.copyRect(CPos("ZZZ10001"), CPos("ZZZ10000"), 2, 1);
+    assert(valueMatch(wide.getValue(CPos("ZZZ10001")), CValue(11.)));
+    assert(valueMatch(wide.getValue(CPos("AAAA10001")), CValue(16.)));
+    saveLoad(wide);
+    assert(valueMatch(wide.getValue(CPos("AAAA10001")), CValue(16.)));
+    assert(valueMatch(wide.getValue(CPos("AAAA10000")), CValue(5.)));
+
+    // Rewriting formulas fills the arena with dead programs until it is compacted,
+    // a copied sheet has to outlive the arena of the original.
+    CSpreadsheet arena;
+    for(int j = 0; j < 10000; j++){
+        arena.setCell(CPos("C" + std::to_string(j % 10)), "=\"s\" + " + std::to_string(j));
+    }
+    auto arenaCopy = std::make_unique<CSpreadsheet>(arena);
+    arena = CSpreadsheet();
+    assert(valueMatch(arenaCopy->getValue(CPos("C3")), CValue("s9993.000000")));
+    arena = *arenaCopy;
+    arenaCopy.reset();
+    assert(valueMatch(arena.getValue(CPos("C9")), CValue("s9999.000000")));
+
+    // Filled down cells share one program, save has to write the text of every position.
+    CSpreadsheet fill;
+    for(int j = 1; j <= 1000; j++){
+        fill.setCell(CPos("A" + std::to_string(j)), std::to_string(j));
+    }
+    fill.setCell(CPos("B1"), "=A1+$A$1+sum(A$1:A1)+\"A1\"");
+    for(int j = 1; j < 1000; j *= 2){
+        fill.copyRect(CPos("B" + std::to_string(j + 1)), CPos("B1"), 1, std::min(j, 1000 - j));
+    }
+    fill.copyRect(CPos("C2"), CPos("B1"), 1, 1);
+    assert(valueMatch(fill.getValue(CPos("B1000")), CValue("501501.000000A1")));
+    saveLoad(fill);
+    assert(valueMatch(fill.getValue(CPos("B1000")), CValue("501501.000000A1")));
+    assert(valueMatch(fill.getValue(CPos("B2")), CValue("6.000000A1")));
+    assert(valueMatch(fill.getValue(CPos("C2")), CValue()));
+    fill.copyRect(CPos("D4"), CPos("B3"), 1, 1);
+    assert(valueMatch(fill.getValue(CPos("D4")), CValue()));
+    fill.copyRect(CPos("D4"), CPos("A4"), 2, 1);
+    assert(valueMatch(fill.getValue(CPos("E4")), CValue("9.000000A1")));
+    saveLoad(fill);
+    assert(valueMatch(fill.getValue(CPos("E4")), CValue("9.000000A1")));
+
+    // A batch has to leave the sheet exactly as the same cells set one by one.
+    std::vector<std::pair<CPos, std::string>> batch;
+    for(int j = 0; j < 1500; j++){
+        std::string row = std::to_string(j);
+        batch.emplace_back(CPos("A" + row), j % 7 ? std::to_string(j) : "x" + row);
+        batch.emplace_back(CPos("B" + row), "=A" + row + "+B" + std::to_string(j + 1));
+    }
+    batch.emplace_back(CPos("B1500"), "=B1490");
+    batch.emplace_back(CPos("C1"), " 0x1p4");
+    batch.emplace_back(CPos("C2"), "12 ");
+    batch.emplace_back(CPos("C3"), "=sum(A0:A1499)");
+    batch.emplace_back(CPos("A5"), "-inf");
+    CSpreadsheet batched;
+    CSpreadsheet sequential;
+    batched.setCell(CPos("B1510"), "=B1500");
+    sequential.setCell(CPos("B1510"), "=B1500");
+    assert(batched.setCells(batch, 4));
+    for(const auto& [pos, contents] : batch){
+        sequential.setCell(pos, contents);
+    }
+    auto batchMatches = [&](){
+        for(int j = 0; j <= 1510; j++){
+            for(std::string col : {"A", "B", "C"}){
+                CPos pos(col + std::to_string(j));
+                if(!valueMatch(batched.getValue(pos), sequential.getValue(pos))){
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+    assert(batchMatches());
+    assert(valueMatch(batched.getValue(CPos("B1510")), CValue()));
+    assert(valueMatch(batched.getValue(CPos("C1")), CValue(16.)));
+    assert(valueMatch(batched.getValue(CPos("C2")), CValue("12 ")));
+    // Breaking the cycle in a batch clears it, a bad formula rejects the whole batch
+    std::vector<std::pair<CPos, std::string>> repair = {{CPos("B1500"), "1"}, {CPos("A5"), "5"}};
+    assert(batched.setCells(repair));
+    sequential.setCell(CPos("B1500"), "1");
+    sequential.setCell(CPos("A5"), "5");
+    assert(batchMatches());
+    assert(valueMatch(batched.getValue(CPos("B1510")), CValue(1.)));
+    std::vector<std::pair<CPos, std::string>> broken = {{CPos("A1"), "7"}, {CPos("A2"), "=1+"}};
+    assert(!batched.setCells(broken));
+    assert(batchMatches());
+
+    // Cell names: letters then digits only, any case, nothing that overflows.
+    assert(CPos("a1").cPosHW == CPos("A1").cPosHW);
+    assert(CPos("AA10").cPosHW == std::make_pair(10, 26));
+    assert(CPos("zz0").cPosHW == std::make_pair(0, 701));
+    for(std::string bad : {"", "A", "12", "A-1", "A+1", "A 1", " A1", "A1 ", "A1B", "$A1", "A$1", "A0x1",
+                           "A99999999999", "ZZZZZZZZ1"}){
+        bool thrown = false;
+        try {
+            CPos pos(bad);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    // Contents are numbers exactly where std::stod would take the whole string.
+    CSpreadsheet classify;
+    std::vector<std::pair<std::string, CValue>> contents = {
+            {"12", CValue(12.)}, {" -1.5e3", CValue(-1500.)}, {"+.5", CValue(0.5)}, {"0x1A", CValue(26.)},
+            {"-0X10", CValue(-16.)}, {"1e400", CValue("1e400")}, {"12 ", CValue("12 ")}, {"--1", CValue("--1")},
+            {"+-1", CValue("+-1")}, {"0x", CValue("0x")}, {"1,5", CValue("1,5")}, {"e5", CValue("e5")},
+            {"", CValue("")}, {" ", CValue(" ")}, {"A1", CValue("A1")}};
+    for(size_t j = 0; j < contents.size(); j++){
+        classify.setCell(CPos(0, j), contents[j].first);
+        assert(valueMatch(classify.getValue(CPos(0, j)), contents[j].second));
+    }
+    assert(std::isinf(std::get<double>((classify.setCell(CPos("A1"), "-inf"), classify.getValue(CPos("A1"))))));
+    assert(std::isnan(std::get<double>((classify.setCell(CPos("A1"), "nan"), classify.getValue(CPos("A1"))))));
+    // A text heavy sheet ingests without an exception per cell.
+    std::future<void> ingest = std::async(std::launch::async, [](){
+        CSpreadsheet text;
+        for(int j = 0; j < 500; j++){
+            for(int c = 0; c < 100; c++){
+                std::string name = numberToLetters(c) + std::to_string(j);
+                text.setCell(CPos(name), "item " + name);
+            }
+        }
+        assert(valueMatch(text.getValue(CPos("CV499")), CValue("item CV499")));
+    });
+    if (ingest.wait_for(std::chrono::seconds(2)) == std::future_status::timeout) {
+        throw std::runtime_error("Ingest of text cells is too slow!");
+    }
+    ingest.get();
+    // Texts and formulas are 8 byte handles into tables holding each text and program once.
+    assert(CellHandle::text(7).isText() && CellHandle::text(7).index() == 7);
+    assert(CellHandle::formula(7).isFormula() && !CellHandle::formula(7).isText());
+    CSpreadsheet handles;
+    for(int j = 0; j < 100; j++){
+        handles.setCell(CPos(j, 0), j % 2 ? "odd" : "even");
+        handles.setCell(CPos(j, 1), "=A" + std::to_string(j) + "+\"!\"");
+    }
+    assert(handles.m_texts.size() == 2 && handles.m_programs.size() == 1);
+    handles.copyRect(CPos("C0"), CPos("A0"), 2, 100);
+    assert(handles.m_texts.size() == 2 && handles.m_programs.size() == 1);
+    assert(valueMatch(handles.getValue(CPos("D99")), CValue("odd!")));
+    // Overwriting the last cells referring to an entry frees it
+    for(int j = 0; j < 98; j += 2){
+        handles.setCell(CPos(j, 0), "1");
+        handles.setCell(CPos(j, 2), "1");
+    }
+    assert(handles.m_texts.size() == 2);
+    handles.setCell(CPos("A98"), "1");
+    handles.setCell(CPos("C98"), "=A98");
+    assert(handles.m_texts.size() == 1 && handles.m_programs.size() == 2);
+    handles.setCell(CPos("C98"), "2");
+    assert(handles.m_programs.size() == 1);
+    // Numbers written over a handle move to the number lane, no handle holds one
+    assert(!handles.m_table.find({98, 2}) && *handles.m_numbers.find({98, 2}) == 2);
+    assert(valueMatch(handles.getValue(CPos("D1")), CValue("odd!")));
+    CSpreadsheet handlesCopy = handles;
+    handles.setCell(CPos("A1"), "changed");
+    assert(handlesCopy.m_texts.size() == 1 && valueMatch(handlesCopy.getValue(CPos("A1")), CValue("odd")));
+    saveLoad(handlesCopy);
+    assert(valueMatch(handlesCopy.getValue(CPos("B99")), CValue("odd!")));
     std::cout<<"SIMPLE_TESTS PASSED\n";
 #endif
 
@@ -264,6 +508,57 @@ void runTests(){
         }
     }
 
+    // Chains deeper than any fixed visit limit are not cycles.
+    CSpreadsheet chain;
+    chain.setCell(CPos("A0"), "1");
+    for(int j = 1; j < 1000; j++){
+        chain.setCell(CPos("A" + std::to_string(j)), "=A" + std::to_string(j - 1) + "+1");
+    }
+    assert(valueMatch(chain.getValue(CPos("A999")), CValue(1000.)));
+
+    // Breaking a cycle makes its cells computable again.
+    chain.setCell(CPos("A0"), "=A999");
+    assert(valueMatch(chain.getValue(CPos("A999")), CValue()));
+    assert(valueMatch(chain.getValue(CPos("A500")), CValue()));
+    chain.setCell(CPos("A0"), "=5");
+    assert(valueMatch(chain.getValue(CPos("A500")), CValue(505.)));
+    saveLoad(chain);
+    assert(valueMatch(chain.getValue(CPos("A999")), CValue(1004.)));
+
+    // A chain entered from its far end checks each new link against the short side of it, not the whole chain.
+    std::future<void> bottomUp = std::async(std::launch::async, []{
+        CSpreadsheet sheet;
+        const int LENGTH = 20000;
+        for(int j = LENGTH - 1; j > 0; j--){
+            sheet.setCell(CPos("C" + std::to_string(j)), "=C" + std::to_string(j - 1) + "+1");
+        }
+        sheet.setCell(CPos("C0"), "1");
+        assert(valueMatch(sheet.getValue(CPos("C19999")), CValue(20000.)));
+        sheet.setCell(CPos("C0"), "=C19999");
+        assert(valueMatch(sheet.getValue(CPos("C10000")), CValue()));
+    });
+    if (bottomUp.wait_for(std::chrono::seconds(10)) == std::future_status::timeout) {
+        throw std::runtime_error("Linking a chain from its end went quadratic!");
+    }
+    bottomUp.get();
+
+    // Chains far deeper than the native stack could hold evaluate all the same.
+    CSpreadsheet deep;
+    const int DEPTH = 100000;
+    deep.setCell(CPos("B0"), "1");
+    for(int j = 1; j < DEPTH; j++){
+        deep.setCell(CPos(j, 1), "=B" + std::to_string(j - 1) + "+1");
+    }
+    deep.setCell(CPos("C0"), "=B" + std::to_string(DEPTH - 1) + "*2");
+    assert(valueMatch(deep.getValue(CPos("C0")), CValue(2. * DEPTH)));
+    deep.setCell(CPos("B0"), "=sum(A0:A9)");
+    deep.setCell(CPos("A5"), "10");
+    assert(valueMatch(deep.getValue(CPos(DEPTH / 2, 1)), CValue(10. + DEPTH / 2)));
+    assert(valueMatch(deep.getValue(CPos("C0")), CValue(2. * (DEPTH + 9))));
+    deep.setCell(CPos("A5"), "=C0");
+    assert(valueMatch(deep.getValue(CPos("C0")), CValue()));
+    assert(valueMatch(deep.getValue(CPos(DEPTH - 1, 1)), CValue()));
+
     std::cout<<"CYCLIC_DEPS_TESTS PASSED\n";
 #endif
 
@@ -321,6 +616,660 @@ void runTests(){
     assert(valueMatch(toLoad.getValue(CPos("Never1")), CValue("Never")));
     assert(valueMatch(fileIo.getValue(CPos("A1")), CValue(0.)));
 
+    // A mapped snapshot has to read the same as the sheet that saved it.
+    CSpreadsheet mapped;
+    setCellRange({"A1", "A2", "A3", "B1", "B2", "B3", "C1", "C2", "D7", "D8"},
+                 {"1", "2.5", "text", "=A1+A2", "=count(A1:C3)", "=C2", "=C1", "=if(B1>3, \"big\", 0)", "=max(A1:B9)", "=D7*2"}, mapped);
+    mapped.setCell(CPos("B2"), "=sum(A1:B1)+\"x\"");
+    mapped.copyRect(CPos("E7"), CPos("D7"), 2, 2);
+    {
+        std::ofstream file("snapshot_test.bin", std::ios::binary);
+        assert(mapped.save(file));
+    }
+    CSnapshot snapshot;
+    assert(snapshot.open("snapshot_test.bin"));
+    for(std::string col : {"A", "B", "C", "D", "E", "F"}){
+        for(int row = 0; row <= 10; row++){
+            CPos pos(col + std::to_string(row));
+            assert(valueMatch(snapshot.getValue(pos), mapped.getValue(pos)));
+        }
+    }
+    assert(valueMatch(snapshot.getValue(CPos("B2")), CValue("4.500000x")));
+    assert(valueMatch(snapshot.getValue(CPos("C1")), CValue()));
+    std::remove("snapshot_test.bin");
+    assert(!snapshot.open("snapshot_test.bin"));
+
+    // A snapshot evaluates a long chain from its far end without nesting a call per cell,
+    // links through a range included
+    CSpreadsheet longChain;
+    longChain.setCell(CPos("A0"), "1");
+    for(int row = 1; row < 200000; row++){
+        longChain.setCell(CPos("A" + std::to_string(row)),
+                          row % 1000 ? "=A" + std::to_string(row - 1) + "+1" : "=sum(A" + std::to_string(row - 1) + ":A" + std::to_string(row - 1) + ")+1");
+    }
+    {
+        std::ofstream file("snapshot_chain_test.bin", std::ios::binary);
+        assert(longChain.save(file));
+    }
+    CSnapshot chainSnapshot;
+    assert(chainSnapshot.open("snapshot_chain_test.bin"));
+    assert(valueMatch(chainSnapshot.getValue(CPos("A199999")), CValue(200000.)));
+    assert(valueMatch(chainSnapshot.getValue(CPos("A1000")), CValue(1001.)));
+    std::remove("snapshot_chain_test.bin");
+
+    // A paged sheet loads tiles on demand but has to behave like the sheet that saved it.
+    CSpreadsheet eager;
+    for(int row = 0; row < 640; row++){
+        eager.setCell(CPos("A" + std::to_string(row)), std::to_string(row));
+        eager.setCell(CPos("B" + std::to_string(row)), "=A" + std::to_string(row) + "*2");
+        eager.setCell(CPos("C" + std::to_string(row)), "t" + std::to_string(row % 3));
+    }
+    setCellRange({"BZ1", "BZ2", "BZ3", "BZ4"}, {"=sum(A0:B639)", "=BZ3", "=BZ2", "=countval(\"t1\", C0:C639)"}, eager);
+    {
+        std::ofstream file("paged_test.bin", std::ios::binary);
+        assert(eager.save(file));
+    }
+    CSpreadsheet paged;
+    assert(paged.open("paged_test.bin", 2));
+    auto pagedMatches = [&](CSpreadsheet& sheet){
+        for(std::string col : {"A", "B", "C", "D", "E", "BZ"}){
+            for(int row = 0; row < 640; row += 7){
+                CPos pos(col + std::to_string(row));
+                if(!valueMatch(sheet.getValue(pos), eager.getValue(pos))){
+                    return false;
+                }
+            }
+        }
+        for(std::string cell : {"BZ1", "BZ2", "BZ3", "BZ4"}){
+            if(!valueMatch(sheet.getValue(CPos(cell)), eager.getValue(CPos(cell)))){
+                return false;
+            }
+        }
+        return true;
+    };
+    assert(pagedMatches(paged));
+    assert(valueMatch(paged.getValue(CPos("BZ1")), CValue(3.0 * 639 * 640 / 2)));
+    // Only the two most recently used tiles of 64 rows and 3 columns stay loaded
+    assert(paged.m_numbers.size() + paged.m_table.size() <= 2 * 64 * 3);
+    assert(paged.m_texts.size() <= 3 && paged.m_programs.size() <= 2 * 64);
+
+    // Edits pin their tiles, dependents in dropped tiles still see them
+    for(CSpreadsheet* sheet : {&eager, &paged}){
+        sheet->setCell(CPos("A5"), "1000");
+        sheet->setCell(CPos("BZ2"), "7");
+        sheet->copyRect(CPos("D600"), CPos("A0"), 2, 3);
+    }
+    assert(pagedMatches(paged));
+    assert(valueMatch(paged.getValue(CPos("B5")), CValue(2000.)));
+    assert(valueMatch(paged.getValue(CPos("BZ3")), CValue(7.)));
+    assert(valueMatch(paged.getValue(CPos("E602")), CValue(4.)));
+
+    CSpreadsheet pagedCopy = paged;
+    CSpreadsheet reloaded;
+    saveLoad(paged);
+    oss.clear();
+    oss.str("");
+    assert(pagedCopy.save(oss));
+    data = oss.str();
+    iss.clear();
+    iss.str(data);
+    assert(reloaded.load(iss));
+    assert(pagedMatches(reloaded));
+    assert(pagedMatches(paged));
+
+    // The mapping outlives the removed file, but it can no longer be opened
+    std::remove("paged_test.bin");
+    assert(pagedMatches(pagedCopy));
+    assert(!pagedCopy.open("paged_test.bin"));
+    assert(pagedMatches(pagedCopy));
+
+    // An aggregate over tiles still in the file reads them from it instead of loading them
+    oss.clear();
+    oss.str("");
+    assert(eager.save(oss));
+    std::string saved = oss.str();
+    {
+        std::ofstream file("paged_test.bin", std::ios::binary);
+        file << saved;
+    }
+    CSpreadsheet scanned;
+    assert(scanned.open("paged_test.bin", 2));
+    assert(valueMatch(scanned.getValue(CPos("BZ4")), eager.getValue(CPos("BZ4"))));
+    assert(scanned.m_numbers.size() + scanned.m_table.size() == 4);
+
+    // Open only reads the directory, a damaged tile is found when it is read and reads as empty
+    uint64_t cellsOffset = 0;
+    for(int i = 7; i >= 0; i--){
+        cellsOffset = cellsOffset << 8 | static_cast<unsigned char>(saved[48 + i]);
+    }
+    saved[cellsOffset + 9] ^= 0x40;
+    {
+        std::ofstream file("paged_test.bin", std::ios::binary);
+        file << saved;
+    }
+    CSpreadsheet damaged;
+    assert(damaged.open("paged_test.bin", 2));
+    for(std::string cell : {"A0", "A63", "C1"}){
+        assert(valueMatch(damaged.getValue(CPos(cell)), CValue()));
+    }
+    for(std::string cell : {"A64", "B100", "C639"}){
+        assert(valueMatch(damaged.getValue(CPos(cell)), eager.getValue(CPos(cell))));
+    }
+    iss.clear();
+    iss.str(saved);
+    assert(!damaged.load(iss));
+    assert(valueMatch(damaged.getValue(CPos("B100")), eager.getValue(CPos("B100"))));
+    std::remove("paged_test.bin");
+
+    // The compact encoding has to load back the same sheet in fewer bytes.
+    setCellRange({"F1", "F2", "F3", "F4", "F5", "F7", "ZZ1000000", "A1000"},
+                 {"-0", "1e300", "-12", "0.5", "nan", "t1", "9007199254740993", "=BZ1+F3"}, eager);
+    oss.clear();
+    oss.str("");
+    assert(eager.saveCompact(oss));
+    std::string compact = oss.str();
+    oss.clear();
+    oss.str("");
+    assert(eager.save(oss));
+    assert(compact.size() < oss.str().size());
+    CSpreadsheet decoded;
+    iss.clear();
+    iss.str(compact);
+    assert(decoded.load(iss));
+    assert(pagedMatches(decoded));
+    for(std::string cell : {"F1", "F2", "F3", "F4", "F5", "F6", "F7", "ZZ1000000", "A1000"}){
+        assert(valueMatch(decoded.getValue(CPos(cell)), eager.getValue(CPos(cell))));
+    }
+    assert(std::signbit(std::get<double>(decoded.getValue(CPos("F1")))));
+    for(size_t i = 0; i < compact.size(); i += 97){
+        std::string broken = compact;
+        broken[i] ^= 0x21;
+        iss.clear();
+        iss.str(broken);
+        assert(!decoded.load(iss));
+        iss.clear();
+        iss.str(compact.substr(0, i));
+        assert(!decoded.load(iss));
+    }
+    assert(pagedMatches(decoded));
+    CSpreadsheet values;
+    for(int row = 0; row < 1000; row++){
+        values.setCell(CPos("A" + std::to_string(row)), std::to_string(row - 500));
+        values.setCell(CPos("B" + std::to_string(row)), row % 2 ? "yes" : "no");
+    }
+    oss.clear();
+    oss.str("");
+    assert(values.saveCompact(oss));
+    compact = oss.str();
+    oss.clear();
+    oss.str("");
+    assert(values.save(oss));
+    assert(compact.size() * 4 < oss.str().size());
+
     std::cout << "FILE_IO_TESTS PASSED\n";
 #endif
+
+#ifdef FUNCTIONS_TESTS
+    CSpreadsheet functions;
+    setCellRange({"A1", "A2", "A3", "A4", "B1", "B2", "B3"}, {"10", "-4", "text", "=A1*2", "=A2", "2.5", "=\"x\""}, functions);
+    setCellRange({"C1", "C2", "C3", "C4", "C5", "C6", "C7"},
+                 {"=sum(A1:B4)", "=count(B4:A1)", "=min($A$1:B4)", "=max(A1:B$4)", "=countval(-4, A1:B4)",
+                  "=countval(\"text\", A1:B4)", "=countval(A10, A1:B4)"}, functions);
+    assert(valueMatch(functions.getValue(CPos("C1")), CValue(24.5)));
+    assert(valueMatch(functions.getValue(CPos("C2")), CValue(7.)));
+    assert(valueMatch(functions.getValue(CPos("C3")), CValue(-4.)));
+    assert(valueMatch(functions.getValue(CPos("C4")), CValue(20.)));
+    assert(valueMatch(functions.getValue(CPos("C5")), CValue(2.)));
+    assert(valueMatch(functions.getValue(CPos("C6")), CValue(1.)));
+    assert(valueMatch(functions.getValue(CPos("C7")), CValue(1.)));
+
+    functions.setCell(CPos("B4"), "1");
+    assert(valueMatch(functions.getValue(CPos("C1")), CValue(25.5)));
+    assert(valueMatch(functions.getValue(CPos("C2")), CValue(8.)));
+    assert(valueMatch(functions.getValue(CPos("C7")), CValue(0.)));
+
+    setCellRange({"D1", "D2", "D3", "D4"}, {"=if(A1>5, \"big\", A1)", "=if(A2, A1, A2)", "=if(A3, 1, 2)", "=sum(E1:E9)"}, functions);
+    assert(valueMatch(functions.getValue(CPos("D1")), CValue("big")));
+    assert(valueMatch(functions.getValue(CPos("D2")), CValue(10.)));
+    assert(valueMatch(functions.getValue(CPos("D3")), CValue()));
+    assert(valueMatch(functions.getValue(CPos("D4")), CValue()));
+
+    // Functions called with the wrong number of arguments do not compile, even if the parser let them through.
+    for(std::string wrong : {"=if(A1, 2)", "=countval(A1:A2)", "=sum(1, A1:A2)"}){
+        std::vector<std::pair<CPos, std::string>> call = {{CPos("Z1"), wrong}};
+        assert(!functions.setCells(call));
+    }
+    for(auto [fn, params] : std::vector<std::pair<std::string, int>>{{"sum", 2}, {"countval", 1}, {"if", 1}}){
+        ASTBuilder builder(0, 0, std::make_shared<std::pmr::monotonic_buffer_resource>());
+        builder.valNumber(1);
+        builder.valRange("A1:A2");
+        bool thrown = false;
+        try {
+            builder.funcCall(fn, params);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    // Ranges move with copyRect, function names and string literals stay intact.
+    functions.setCell(CPos("E1"), "=sum(A1:A2)");
+    functions.copyRect(CPos("E2"), CPos("E1"), 1, 1);
+    functions.copyRect(CPos("F1"), CPos("D1"), 1, 1);
+    assert(valueMatch(functions.getValue(CPos("E2")), CValue(-4.)));
+    assert(valueMatch(functions.getValue(CPos("F1")), CValue("big")));
+    assert(valueMatch(functions.getValue(CPos("D4")), CValue(2.)));
+    saveLoad(functions);
+    assert(valueMatch(functions.getValue(CPos("E2")), CValue(-4.)));
+    assert(valueMatch(functions.getValue(CPos("F1")), CValue("big")));
+    assert(valueMatch(functions.getValue(CPos("D4")), CValue(2.)));
+
+    // A range covering its own cell is a cycle.
+    functions.setCell(CPos("A5"), "=sum(A1:A5)");
+    assert(valueMatch(functions.getValue(CPos("A5")), CValue()));
+    assert(valueMatch(functions.getValue(CPos("C1")), CValue(25.5)));
+
+    // Ranges are kept whole in the dependency graph, wide ones by row and tall ones by column.
+    CSpreadsheet ranged;
+    setCellRange({"J1", "J2", "Q10"}, {"=sum(A10:Z10)", "=count(Q1:Q100000)", "3"}, ranged);
+    assert(valueMatch(ranged.getValue(CPos("J1")), CValue(3.)));
+    assert(valueMatch(ranged.getValue(CPos("J2")), CValue(1.)));
+    ranged.setCell(CPos("Q10"), "=J1");
+    assert(valueMatch(ranged.getValue(CPos("J1")), CValue()));
+    assert(valueMatch(ranged.getValue(CPos("J2")), CValue(0.)));
+    ranged.setCell(CPos("Q99999"), "=J2");
+    assert(valueMatch(ranged.getValue(CPos("J2")), CValue()));
+    setCellRange({"Q10", "Q99999"}, {"4", "5"}, ranged);
+    assert(valueMatch(ranged.getValue(CPos("J1")), CValue(4.)));
+    assert(valueMatch(ranged.getValue(CPos("J2")), CValue(2.)));
+    // A cycle through the ranges of two formulas, broken by moving one of them away
+    setCellRange({"K1", "K3", "K9"}, {"=sum(K2:K3)", "=max(K1:K1)", "7"}, ranged);
+    assert(valueMatch(ranged.getValue(CPos("K1")), CValue()));
+    assert(valueMatch(ranged.getValue(CPos("K3")), CValue()));
+    ranged.setCell(CPos("K1"), "=K9");
+    assert(valueMatch(ranged.getValue(CPos("K3")), CValue(7.)));
+    ranged.setCell(CPos("K9"), "8");
+    assert(valueMatch(ranged.getValue(CPos("K3")), CValue(8.)));
+    saveLoad(ranged);
+    assert(valueMatch(ranged.getValue(CPos("K3")), CValue(8.)));
+    assert(valueMatch(ranged.getValue(CPos("J2")), CValue(2.)));
+
+    // Tall ranges go through the column index, which has to follow writes.
+    CSpreadsheet tall;
+    for (int row = 1; row <= 1000; ++row) {
+        tall.setCell(CPos("G" + std::to_string(row)), std::to_string(row));
+    }
+    setCellRange({"H1", "H2", "H3", "H4"}, {"=sum(G1:G1000)", "=max(G3:G999)", "=count(G1:G1000)", "=min(G70:G1000)"}, tall);
+    assert(valueMatch(tall.getValue(CPos("H1")), CValue(500500.)));
+    assert(valueMatch(tall.getValue(CPos("H2")), CValue(999.)));
+    assert(valueMatch(tall.getValue(CPos("H3")), CValue(1000.)));
+    assert(valueMatch(tall.getValue(CPos("H4")), CValue(70.)));
+    setCellRange({"G500", "G999", "G70"}, {"text", "5000", "-1"}, tall);
+    assert(valueMatch(tall.getValue(CPos("H1")), CValue(500500. - 500 + 4001 - 71)));
+    assert(valueMatch(tall.getValue(CPos("H2")), CValue(5000.)));
+    assert(valueMatch(tall.getValue(CPos("H3")), CValue(1000.)));
+    assert(valueMatch(tall.getValue(CPos("H4")), CValue(-1.)));
+
+    // Formulas over large ranges cost an entry per range, not an edge per cell, so linking them, editing
+    // the cells they cover and summing them again is quick however many cells the ranges span.
+    std::future<void> large = std::async(std::launch::async, []{
+        CSpreadsheet sheet;
+        std::vector<std::pair<CPos, std::string>> cells;
+        for (int row = 1; row <= 100000; ++row) {
+            cells.emplace_back(CPos("A" + std::to_string(row)), "1");
+        }
+        for (int row = 1; row <= 200; ++row) {
+            cells.emplace_back(CPos("B" + std::to_string(row)), "=sum($A$1:$A$100000)");
+        }
+        cells.emplace_back(CPos("C1"), "=sum(A1:A1000000)");
+        cells.emplace_back(CPos("C2"), "=count(D1:ZZ20000)");
+        assert(sheet.setCells(cells));
+        for (int edit = 1; edit <= 3; ++edit) {
+            sheet.setCell(CPos("A" + std::to_string(edit * 1000)), "2");
+            sheet.setCell(CPos("ZZ" + std::to_string(edit * 1000)), "2");
+            assert(valueMatch(sheet.getValue(CPos("B200")), CValue(100000. + edit)));
+            assert(valueMatch(sheet.getValue(CPos("C1")), CValue(100000. + edit)));
+            assert(valueMatch(sheet.getValue(CPos("C2")), CValue(static_cast<double>(edit))));
+        }
+    });
+    if (large.wait_for(std::chrono::seconds(10)) == std::future_status::timeout) {
+        throw std::runtime_error("Large ranges are expanded cell by cell!");
+    }
+    large.get();
+
+    // A tall range over a nearly empty column costs its few tiles, not a summary per 64 rows.
+    std::future<void> sparse = std::async(std::launch::async, []{
+        CSpreadsheet sheet;
+        setCellRange({"A1", "A1999999999", "B1", "B2", "B3"},
+                     {"3", "-1", "=sum(A1:A1000000000)", "=countval(3, A1:A2000000000)", "=min(A1:A2000000000)"}, sheet);
+        for (int edit = 1; edit <= 3; ++edit) {
+            sheet.setCell(CPos("A" + std::to_string(edit * 100000000)), "1");
+            assert(valueMatch(sheet.getValue(CPos("B1")), CValue(3. + edit)));
+            assert(valueMatch(sheet.getValue(CPos("B2")), CValue(1.)));
+            assert(valueMatch(sheet.getValue(CPos("B3")), CValue(-1.)));
+        }
+    });
+    if (sparse.wait_for(std::chrono::seconds(2)) == std::future_status::timeout) {
+        throw std::runtime_error("Sparse ranges are summarized block by block!");
+    }
+    sparse.get();
+
+    // Constant parts of a formula are computed once when it is compiled.
+    auto compiled = [](const std::string& formula){
+        ASTBuilder builder(0, 0, std::make_shared<std::pmr::monotonic_buffer_resource>());
+        parseExpression(formula, builder);
+        return builder.getExpression();
+    };
+    assert(compiled("=5e+1")->code.size() == 1);
+    assert(compiled("=2^10*A1")->code.size() == 3);
+    assert(compiled("=-(-(A1*2))")->code.size() == 3);
+    assert(compiled("=-(-A1)")->code.size() == 3); // A text in A1 has to stay undefined
+    assert(compiled("=\"a\" + \"b\" + A1")->strings.size() == 1);
+    assert(compiled("=if(1 < 2, \"yes\", \"no\")")->code.size() == 1);
+    assert(compiled("=1/0")->code.size() == 3); // Undefined has no literal
+    CSpreadsheet folded;
+    setCellRange({"A1", "A2", "B1", "B2", "B3", "B4", "B5", "B6", "B7", "B8"},
+                 {"3", "text", "=2^10*A1", "=-(-A1)", "=-(-A2)", "=\"a\" + \"b\" + A1", "=1/0", "=\"x\" + 1",
+                  "=if(\"c\" < \"d\", -(-(A1*2)), 0)", "=--$A$1"}, folded);
+    auto foldedMatches = [&](){
+        return valueMatch(folded.getValue(CPos("B1")), CValue(3072.))
+            && valueMatch(folded.getValue(CPos("B2")), CValue(3.))
+            && valueMatch(folded.getValue(CPos("B3")), CValue())
+            && valueMatch(folded.getValue(CPos("B4")), CValue("ab3.000000"))
+            && valueMatch(folded.getValue(CPos("B5")), CValue())
+            && valueMatch(folded.getValue(CPos("B6")), CValue("x1.000000"))
+            && valueMatch(folded.getValue(CPos("B7")), CValue(6.))
+            && valueMatch(folded.getValue(CPos("B8")), CValue(3.));
+    };
+    assert(foldedMatches());
+    // Copies and saved files still get the formulas as written
+    folded.copyRect(CPos("C1"), CPos("B1"), 1, 8);
+    folded.setCell(CPos("B1"), "4");
+    saveLoad(folded);
+    assert(valueMatch(folded.getValue(CPos("C1")), CValue(4096.)));
+    assert(valueMatch(folded.getValue(CPos("C4")), CValue("ab4.000000")));
+    folded.setCell(CPos("B1"), "=2^10*A1");
+    assert(foldedMatches());
+    std::ostringstream text;
+    assert(folded.save(text));
+    assert(text.str().find("2^10*A1") != std::string::npos);
+    assert(text.str().find("\"a\" + \"b\" + A1") != std::string::npos);
+
+    // Formulas equal up to their position share one template, absolute parts and literals do not move.
+    assert(templateKey("=A1 + 1", 1, 1) == templateKey("=A5 + 1", 5, 1));
+    assert(templateKey("=A1 + 1", 1, 1) == templateKey("=b2 + 1", 2, 2));
+    assert(templateKey("=A1 + 1", 1, 1) != templateKey("=A1+1", 1, 1));
+    assert(templateKey("=$A$1 + 1", 1, 1) != templateKey("=$A$5 + 1", 5, 1));
+    assert(templateKey("=$A1 + B$1", 1, 1) == templateKey("=$A2 + C$1", 2, 2));
+    assert(templateKey("=\"A1\" + A1", 1, 1) != templateKey("=\"A2\" + A2", 2, 1));
+    assert(templateKey("=sum(A1:B2) + 5e1", 1, 1) == templateKey("=sum(A2:B3) + 5e1", 2, 1));
+    assert(!templateKey("=A99999999999", 0, 0));
+    CSpreadsheet filled;
+    std::vector<std::pair<CPos, std::string>> fillDown;
+    for (int row = 1; row <= 1000; ++row) {
+        std::string r = std::to_string(row);
+        filled.setCell(CPos("A" + r), r);
+        filled.setCell(CPos("B" + r), "=A" + r + " * 2 + $A$1");
+        fillDown.emplace_back(CPos("C" + r), "=B" + r + " - A" + r);
+        fillDown.emplace_back(CPos("D" + r), "=sum($B$1:B" + r + ")");
+    }
+    assert(filled.setCells(fillDown));
+    auto filledMatches = [&](int sumOffset){
+        for (int row = 1; row <= 1000; ++row) {
+            std::string r = std::to_string(row);
+            if (!valueMatch(filled.getValue(CPos("B" + r)), CValue(2. * row + 1))
+                || !valueMatch(filled.getValue(CPos("C" + r)), CValue(row + 1.))
+                || !valueMatch(filled.getValue(CPos("D" + r)), CValue(row * (row + 2.) + sumOffset))) {
+                return false;
+            }
+        }
+        return true;
+    };
+    assert(filledMatches(0));
+    // Four programs for four thousand formulas, the saved file holds each of them once
+    std::ostringstream filledFile;
+    assert(filled.saveCompact(filledFile));
+    assert(filledFile.str().size() < 16000);
+    // Overwriting the cell a template was compiled for leaves the other cells alone
+    filled.setCell(CPos("B1"), "=A1 * 2 + $A$1");
+    filled.setCell(CPos("C1"), "5");
+    filled.setCell(CPos("C1"), "=B1 - A1");
+    saveLoad(filled);
+    assert(filledMatches(0));
+
+    // Concatenation reads texts in place and prints numbers like std::to_string, in any nesting.
+    CSpreadsheet concat;
+    setCellRange({"A1", "A2", "A3", "A4", "A5", "A6", "A7"},
+                 {"ab", "3", "=A1+A2+A1", "=A2+(A1+(A1+A2))", "=A1=\"ab\"", "=A1<\"b\"", "=countval(\"ab\", A1:A3)"}, concat);
+    assert(valueMatch(concat.getValue(CPos("A3")), CValue("ab3.000000ab")));
+    assert(valueMatch(concat.getValue(CPos("A4")), CValue("3.000000abab3.000000")));
+    assert(valueMatch(concat.getValue(CPos("A5")), CValue(1.)));
+    assert(valueMatch(concat.getValue(CPos("A6")), CValue(1.)));
+    assert(valueMatch(concat.getValue(CPos("A7")), CValue(1.)));
+    std::vector<std::string> numbers = {"1e300", "-0", "0.1", "2.5e-7", "5e-7", "123456789.1234565", "-1e-300", "1e22"};
+    for (size_t i = 0; i < numbers.size(); ++i) {
+        std::string row = std::to_string(i + 1);
+        concat.setCell(CPos("B" + row), numbers[i]);
+        concat.setCell(CPos("C" + row), "=B" + row + "+\"\"");
+        assert(valueMatch(concat.getValue(CPos("C" + row)), CValue(std::to_string(std::stod(numbers[i])))));
+    }
+    concat.setCell(CPos("C10"), "=\"x\"+1e308*10");
+    assert(valueMatch(concat.getValue(CPos("C10")), CValue("x" + std::to_string(HUGE_VAL))));
+    // A long chain over text cells and a long chain over the results of other formulas
+    std::string textChain = "=";
+    std::string expected;
+    for (int row = 0; row < 300; ++row) {
+        std::string r = std::to_string(row);
+        concat.setCell(CPos("E" + r), "part " + r + ";");
+        concat.setCell(CPos("G" + r), row ? "=G" + std::to_string(row - 1) + "+E" + r : "=E0");
+        textChain += (row ? "+E" : "E") + r;
+        expected += "part " + r + ";";
+    }
+    concat.setCell(CPos("F0"), textChain);
+    assert(valueMatch(concat.getValue(CPos("F0")), CValue(expected)));
+    assert(valueMatch(concat.getValue(CPos("G299")), CValue(expected)));
+    concat.setCell(CPos("E0"), "first;");
+    expected.replace(0, 7, "first;");
+    assert(valueMatch(concat.getValue(CPos("G299")), CValue(expected)));
+    saveLoad(concat);
+    assert(valueMatch(concat.getValue(CPos("F0")), CValue(expected)));
+    assert(valueMatch(concat.getValue(CPos("A4")), CValue("3.000000abab3.000000")));
+
+    std::cout << "FUNCTIONS_TESTS PASSED\n";
+#endif
+
+#ifdef RECALC_TESTS
+    CSpreadsheet parallel;
+    for (int row = 1; row <= 2000; ++row) {
+        std::string r = std::to_string(row);
+        parallel.setCell(CPos("A" + r), std::to_string(rand() % 1000 / 7.));
+        parallel.setCell(CPos("B" + r), row == 1 ? "=A1" : "=A" + r + "*1.1+B" + std::to_string(row - 1) + "/3");
+        parallel.setCell(CPos("C" + r), "=sum(A" + r + ":B" + std::to_string(row + 5) + ")^0.5");
+        parallel.setCell(CPos("D" + r), "=if(C" + r + ">40, \"x\"+C" + r + ", A" + r + ")");
+    }
+    parallel.setCell(CPos("E1"), "=E2");
+    parallel.setCell(CPos("E2"), "=E1+D5");
+    // Formulas filled down a column are evaluated as blocks, with texts, empty cells, division by zero
+    // and cycles among their operands.
+    for (int row = 1; row <= 2000; ++row) {
+        std::string r = std::to_string(row);
+        std::string next = std::to_string(row + 1);
+        parallel.setCell(CPos("F" + r), "=(A" + r + "-$A$1)/(A" + r + "-A" + next + ")");
+        parallel.setCell(CPos("G" + r), "=if(A" + r + ">50, -(-F" + r + "), $A$2^2)");
+        parallel.setCell(CPos("H" + r), "=(G" + r + ">=A" + r + ") + K" + r + "*2");
+        parallel.setCell(CPos("I" + r), "=E1 + A" + r);
+        parallel.setCell(CPos("J" + r), "=B" + r + "-C" + r + "/D$7");
+        // Tall ranges read the number index, which the workers share without a lock
+        parallel.setCell(CPos("L" + r), "=sum(A" + r + ":A" + std::to_string(row + 300) + ")+max($A$1:$A$2000)");
+    }
+    setCellRange({"A10", "A11", "A100", "A150", "K5", "K6", "K7"}, {"5", "5", "text", "", "1", "=A1", "x"}, parallel);
+    for (int round = 0; round < 2; ++round) {
+        CSpreadsheet serial = parallel;
+        parallel.recalculateAll(4);
+        for (int row = 1; row <= 2000; ++row) {
+            for (std::string col : {"A", "B", "C", "D", "E", "F", "G", "H", "I", "J", "L"}) {
+                CPos pos(col + std::to_string(row));
+                assert(parallel.getValue(pos) == serial.getValue(pos));
+            }
+        }
+        parallel.setCell(CPos("A3"), "1e3");
+    }
+
+    // Readers on other threads see whole published versions while the writer goes on changing the sheet.
+    CSpreadsheet versioned;
+    assert(!versioned.pin());
+    for (int row = 1; row <= 1000; ++row) {
+        std::string r = std::to_string(row);
+        versioned.setCell(CPos("B" + r), "=$A$1*2+" + r);
+        versioned.setCell(CPos("C" + r), "=B" + r + "+\" done\"");
+    }
+    versioned.setCell(CPos("A1"), "0");
+    versioned.publish(4);
+    std::shared_ptr<const CSheetVersion> first = versioned.pin();
+    assert(first->number() == 1 && valueMatch(first->getValue(CPos("B1000")), CValue(1000.)));
+    std::atomic<bool> writing = true;
+    std::vector<std::thread> readers;
+    std::atomic<int> consistent = 0;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&, t] {
+            uint64_t last = 0;
+            for (int reads = 0; writing || reads < 20; ++reads) {
+                std::shared_ptr<const CSheetVersion> version = versioned.pin();
+                double a = std::get<double>(version->getValue(CPos("A1")));
+                int row = 1 + (reads * 37 + t * 101) % 1000;
+                std::string r = std::to_string(row);
+                if (version->number() < last || !valueMatch(version->getValue(CPos("B" + r)), CValue(a * 2 + row))
+                    || !valueMatch(version->getValue(CPos("C" + r)), CValue(std::to_string(a * 2 + row) + " done"))) {
+                    return;
+                }
+                last = version->number();
+                // Spinning readers would take the only CPU of a small machine from the writer
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            consistent++;
+        });
+    }
+    for (int edit = 1; edit <= 30; ++edit) {
+        versioned.setCell(CPos("A1"), std::to_string(edit));
+        versioned.publish(edit % 2 ? 4 : 1);
+    }
+    writing = false;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    assert(consistent == 4);
+    assert(versioned.pin()->number() == 31 && valueMatch(versioned.pin()->getValue(CPos("B1")), CValue(61.)));
+    // A pinned version keeps its values, edits show in the next one only
+    std::shared_ptr<const CSheetVersion> before = versioned.pin();
+    versioned.copyRect(CPos("B1"), CPos("Z1"), 1, 2);
+    versioned.setCell(CPos("C3"), "=C4");
+    versioned.setCell(CPos("C4"), "=C3");
+    versioned.setCell(CPos("D1"), "new");
+    assert(valueMatch(versioned.pin()->getValue(CPos("B1")), CValue(61.)));
+    versioned.publish();
+    std::shared_ptr<const CSheetVersion> after = versioned.pin();
+    for (std::string cell : {"B1", "B2", "C1", "C3", "C4", "D1"}) {
+        assert(valueMatch(after->getValue(CPos(cell)), versioned.getValue(CPos(cell))));
+    }
+    assert(valueMatch(after->getValue(CPos("B1")), CValue()) && valueMatch(after->getValue(CPos("D1")), CValue("new")));
+    assert(valueMatch(before->getValue(CPos("B1")), CValue(61.)) && valueMatch(before->getValue(CPos("C3")), CValue("63.000000 done")));
+    assert(valueMatch(first->getValue(CPos("C2")), CValue("2.000000 done")));
+    // A loaded sheet is published whole again
+    saveLoad(versioned);
+    versioned.publish();
+    assert(versioned.pin()->number() == 33 && valueMatch(versioned.pin()->getValue(CPos("B5")), CValue(65.)));
+
+    // Values asked for asynchronously come from the background worker, which then drains the other dirty cells.
+    CSpreadsheet background;
+    for (int row = 0; row < 5000; ++row) {
+        std::string r = std::to_string(row);
+        background.setCell(CPos("A" + r), row ? "=A" + std::to_string(row - 1) + "+1" : "1");
+        background.setCell(CPos("B" + r), "=A" + r + "*2+\"\"");
+    }
+    std::future<CValue> ready = background.getValueAsync(CPos("A0"));
+    assert(ready.wait_for(std::chrono::seconds(0)) == std::future_status::ready && valueMatch(ready.get(), CValue(1.)));
+    std::future<CValue> farEnd = background.getValueAsync(CPos("B4999"));
+    std::future<CValue> cycle = (background.setCell(CPos("C0"), "=C0"), background.getValueAsync(CPos("C0")));
+    assert(valueMatch(farEnd.get(), CValue(std::to_string(10000.))) && valueMatch(cycle.get(), CValue()));
+    // Edits made meanwhile are picked up, the owner reads the same values synchronously
+    std::vector<std::future<CValue>> answers;
+    for (int edit = 1; edit <= 20; ++edit) {
+        background.setCell(CPos("A0"), std::to_string(edit));
+        answers.push_back(background.getValueAsync(CPos("A" + std::to_string(edit * 200))));
+    }
+    for (int edit = 1; edit <= 20; ++edit) {
+        assert(valueMatch(answers[edit - 1].get(), CValue(20. + edit * 200)));
+    }
+    assert(valueMatch(background.getValue(CPos("B100")), CValue(std::to_string(240.))));
+    auto drained = [&]() {
+        auto lock = background.m_background.lock();
+        return background.m_background.dirty.empty() && !background.m_background.reseed
+               && background.m_cache.size() == 2 * 5000 - 1;
+    };
+    for (int wait = 0; wait < 2000 && !drained(); ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    assert(drained());
+    // A copy leaves the worker of its source running, an assignment stops the worker of the sheet assigned to
+    background.setCell(CPos("A0"), "0");
+    std::future<CValue> pending = background.getValueAsync(CPos("B4999"));
+    CSpreadsheet backgroundCopy = background;
+    assert(background.m_background.running() && !backgroundCopy.m_background.running());
+    assert(valueMatch(pending.get(), CValue(std::to_string(9998.))));
+    assert(valueMatch(backgroundCopy.getValueAsync(CPos("A4999")).get(), CValue(4999.)));
+    assert(backgroundCopy.m_background.running());
+    background.setCell(CPos("A0"), "1");
+    backgroundCopy = background;
+    assert(background.m_background.running() && !backgroundCopy.m_background.running());
+    assert(valueMatch(backgroundCopy.getValue(CPos("B4999")), CValue(std::to_string(10000.))));
+    assert(valueMatch(background.getValueAsync(CPos("B4999")).get(), CValue(std::to_string(10000.))));
+
+    // Subscribers hear of the cells whose value an edit actually changed, once per edit.
+    CSpreadsheet watched;
+    setCellRange({"A1", "A2", "B1", "B2", "C1"}, {"1", "2", "=A1+A2", "=B1*0", "=sum(A1:A2)"}, watched);
+    using Changes = std::vector<std::pair<CPos, CValue>>;
+    std::vector<Changes> column, block;
+    auto same = [](const Changes& changes, const std::vector<std::pair<std::string, CValue>>& expected) {
+        if (changes.size() != expected.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < changes.size(); ++i) {
+            if (changes[i].first.cPosHW != CPos(expected[i].first).cPosHW || !valueMatch(changes[i].second, expected[i].second)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    watched.subscribe(CPos("B1"), 1, 2, [&](const Changes& changes) { column.push_back(changes); });
+    size_t blockId = watched.subscribe(CPos("A1"), 3, 2, [&](const Changes& changes) {
+        // The sheet is free to read while the callback runs
+        for (const auto& [pos, value] : changes) {
+            assert(valueMatch(watched.getValue(pos), value));
+        }
+        block.push_back(changes);
+    });
+    watched.setCell(CPos("A1"), "5");
+    assert(column.size() == 1 && same(column[0], {{"B1", 7.}}));
+    assert(block.size() == 1 && same(block[0], {{"A1", 5.}, {"B1", 7.}, {"C1", 7.}}));
+    watched.setCell(CPos("A1"), "5");
+    saveLoad(watched);
+    assert(column.size() == 1 && block.size() == 1);
+    std::vector<std::pair<CPos, std::string>> both = {{CPos("A1"), "1"}, {CPos("A2"), "3"}};
+    watched.setCells(both);
+    assert(column.size() == 2 && same(column[1], {{"B1", 4.}}));
+    assert(block.size() == 2 && same(block[1], {{"A1", 1.}, {"B1", 4.}, {"C1", 4.}, {"A2", 3.}}));
+    watched.copyRect(CPos("A2"), CPos("Z9"));
+    watched.setCell(CPos("B2"), "=B2");
+    // Undefined before and on the cycle, so no change
+    assert(column.size() == 3 && same(column[2], {{"B1", CValue()}, {"B2", CValue()}}));
+    assert(block.size() == 3 && same(block[2], {{"B1", CValue()}, {"C1", 1.}, {"A2", CValue()}, {"B2", CValue()}}));
+    watched.unsubscribe(blockId);
+    watched.setCell(CPos("A2"), "1");
+    watched.setCell(CPos("C2"), "changed");
+    assert(block.size() == 3 && column.size() == 4 && same(column[3], {{"B1", 2.}}));
+    CSpreadsheet watchedCopy = watched;
+    watchedCopy.setCell(CPos("A1"), "100");
+    assert(column.size() == 4);
+    std::cout << "RECALC_TESTS PASSED\n";
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,600 @@
+//
+// Binary workbook format written by CSpreadsheet::save, read by load and mapped by open and CSnapshot.
+//
+// All integers are little endian regardless of the host, doubles are stored as their IEEE 754 bits.
+// Every part can be found from the header without reading the parts before it.
+//   header    magic "SPRD", u32 version, u32 string, program, tile and cell counts,
+//             u64 file offsets of the strings, programs, tiles and cells sections
+//   strings   u64 file offset of each string, then u32 length and the bytes of each;
+//             cell texts, formula sources and literals
+//   programs  u64 file offset of each program, then each compiled formula as written by writeProgram
+//   tiles     directory of the 64x64 tiles holding cells, sorted by tile row and column:
+//             i32 tile row, i32 tile col, u32 index of its first cell, u32 cell count,
+//             u64 FNV-1a hash of the tile's cell records
+//   cells     fixed size records grouped by tile in directory order, sorted by row and column within a tile:
+//             i32 row, i32 col, u8 type, u64 payload;
+//             1 number (f64 bits), 2 text (string index), 3 formula (program index), type | 0x80 marks a formula on a cycle
+//   checksum  u64 FNV-1a hash of all preceding bytes, load checks it. open only reads the directory and
+//             checks each tile against its own hash when it first reads it.
+//
+// The compact encoding written by CSpreadsheet::saveCompact trades random access for size and can only be loaded:
+//   header    magic "SPRC", u32 version
+//   strings   varint count, then varint length and the bytes of each
+//   programs  varint count, then each program as written by writeProgram
+//   cells     varint count, then the cells in row-major order, each a tag byte, its position and its value
+//             tag bits 0-1: 0 number (f64 bits), 1 integral number (zigzag varint), 2 text, 3 formula (varint index)
+//             tag bits 2-3: 0 the column after the previous cell, 1 same row (varint columns skipped),
+//                           2 new row (zigzag varint row delta, zigzag varint column)
+//   checksum  u64 FNV-1a hash of all preceding bytes
+//
+
+#ifndef VELKA_ULOHA_WORKBOOKFORMAT_H
+#define VELKA_ULOHA_WORKBOOKFORMAT_H
+
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+constexpr char WORKBOOK_MAGIC[4] = {'S', 'P', 'R', 'D'};
+constexpr uint32_t WORKBOOK_VERSION = 4;
+constexpr size_t WORKBOOK_HEADER_SIZE = 56;
+constexpr size_t WORKBOOK_TILE_SIZE = 24;
+constexpr size_t WORKBOOK_CELL_SIZE = 17;
+constexpr int WORKBOOK_TILE_BITS = 6;
+constexpr char WORKBOOK_COMPACT_MAGIC[4] = {'S', 'P', 'R', 'C'};
+constexpr uint32_t WORKBOOK_COMPACT_VERSION = 1;
+constexpr uint8_t WORKBOOK_CYCLIC = 0x80;
+
+enum WorkbookCellType : uint8_t {
+    NumberCell = 1,
+    TextCell = 2,
+    FormulaCell = 3
+};
+
+// Tag bits of a cell in the compact encoding.
+enum CompactCellTag : uint8_t {
+    CompactNumber = 0,
+    CompactInteger = 1,
+    CompactText = 2,
+    CompactFormula = 3,
+    CompactNextColumn = 0 << 2,
+    CompactSameRow = 1 << 2,
+    CompactNewRow = 2 << 2
+};
+
+inline uint64_t zigzag(int64_t val) {
+    return (static_cast<uint64_t>(val) << 1) ^ static_cast<uint64_t>(val >> 63);
+}
+inline int64_t unzigzag(uint64_t val) {
+    return static_cast<int64_t>(val >> 1) ^ -static_cast<int64_t>(val & 1);
+}
+
+inline uint64_t workbookChecksum(std::string_view data) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : data) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+class WorkbookWriter {
+public:
+    void u8(uint8_t val) {
+        m_data.push_back(static_cast<char>(val));
+    }
+    void u32(uint32_t val) {
+        for (int shift = 0; shift < 32; shift += 8) {
+            u8(static_cast<uint8_t>(val >> shift));
+        }
+    }
+    void u64(uint64_t val) {
+        for (int shift = 0; shift < 64; shift += 8) {
+            u8(static_cast<uint8_t>(val >> shift));
+        }
+    }
+    void i32(int32_t val) {
+        u32(static_cast<uint32_t>(val));
+    }
+    void f64(double val) {
+        u64(std::bit_cast<uint64_t>(val));
+    }
+    void bytes(std::string_view val) {
+        m_data.append(val);
+    }
+    // LEB128: seven bits per byte, low bits first, the high bit set on all but the last byte.
+    void varint(uint64_t val) {
+        while (val >= 0x80) {
+            u8(static_cast<uint8_t>(val | 0x80));
+            val >>= 7;
+        }
+        u8(static_cast<uint8_t>(val));
+    }
+
+    std::string& data() {
+        return m_data;
+    }
+
+private:
+    std::string m_data;
+};
+
+// Reads from a buffer, throws std::runtime_error when a value does not fit in the remaining data.
+class WorkbookReader {
+public:
+    explicit WorkbookReader(std::string_view data) : m_data(data) {}
+
+    uint8_t u8() {
+        need(1);
+        return static_cast<uint8_t>(m_data[m_pos++]);
+    }
+    uint32_t u32() {
+        need(4);
+        uint32_t val = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            val |= static_cast<uint32_t>(static_cast<uint8_t>(m_data[m_pos++])) << shift;
+        }
+        return val;
+    }
+    uint64_t u64() {
+        need(8);
+        uint64_t val = 0;
+        for (int shift = 0; shift < 64; shift += 8) {
+            val |= static_cast<uint64_t>(static_cast<uint8_t>(m_data[m_pos++])) << shift;
+        }
+        return val;
+    }
+    int32_t i32() {
+        return static_cast<int32_t>(u32());
+    }
+    double f64() {
+        return std::bit_cast<double>(u64());
+    }
+    std::string_view bytes(size_t len) {
+        need(len);
+        std::string_view val = m_data.substr(m_pos, len);
+        m_pos += len;
+        return val;
+    }
+    uint64_t varint() {
+        uint64_t val = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t byte = u8();
+            if (shift == 63 && byte > 1) {
+                break;
+            }
+            val |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return val;
+            }
+        }
+        throw std::runtime_error("Malformed varint");
+    }
+    // Reads a varint element count, rejecting counts that could not fit in the rest of the data.
+    uint64_t varcount() {
+        uint64_t val = varint();
+        if (val > remaining()) {
+            throw std::runtime_error("Element count exceeds the data");
+        }
+        return val;
+    }
+    // Reads an element count, rejecting counts that could not fit in the rest of the data.
+    uint32_t count(size_t minElementSize) {
+        uint32_t val = u32();
+        if (minElementSize && val > remaining() / minElementSize) {
+            throw std::runtime_error("Element count exceeds the data");
+        }
+        return val;
+    }
+
+    size_t remaining() const {
+        return m_data.size() - m_pos;
+    }
+    void seek(uint64_t pos) {
+        if (pos > m_data.size()) {
+            throw std::runtime_error("Offset out of range");
+        }
+        m_pos = pos;
+    }
+
+private:
+    void need(size_t len) const {
+        if (len > remaining()) {
+            throw std::runtime_error("Unexpected end of data");
+        }
+    }
+
+    std::string_view m_data;
+    size_t m_pos = 0;
+};
+
+// Collects distinct strings in the order they were first seen.
+class WorkbookStrings {
+public:
+    uint32_t intern(std::string_view str) {
+        auto [it, inserted] = m_index.emplace(std::string(str), static_cast<uint32_t>(m_strings.size()));
+        if (inserted) {
+            m_strings.push_back(&it->first);
+            m_bytes += sizeof(uint64_t) + sizeof(uint32_t) + str.size();
+        }
+        return it->second;
+    }
+
+    size_t size() const {
+        return m_strings.size();
+    }
+    // Size of the written section.
+    size_t byteSize() const {
+        return m_bytes;
+    }
+    // Writes the section, which starts at file offset base.
+    void write(WorkbookWriter& out, uint64_t base) const {
+        uint64_t offset = base + sizeof(uint64_t) * m_strings.size();
+        for (const std::string* str : m_strings) {
+            out.u64(offset);
+            offset += sizeof(uint32_t) + str->size();
+        }
+        for (const std::string* str : m_strings) {
+            out.u32(static_cast<uint32_t>(str->size()));
+            out.bytes(*str);
+        }
+    }
+
+    void writeCompact(WorkbookWriter& out) const {
+        out.varint(m_strings.size());
+        for (const std::string* str : m_strings) {
+            out.varint(str->size());
+            out.bytes(*str);
+        }
+    }
+
+private:
+    std::unordered_map<std::string, uint32_t> m_index;
+    std::vector<const std::string*> m_strings;
+    size_t m_bytes = 0;
+};
+
+// Program record: u32 source string, i32 origin row, i32 origin col,
+// u32 count of literals and their u32 string indices, u32 count of ranges and for each
+// u8 absolute flags and i32 row, col of both corners, u32 count of instructions and for each
+// u8 opcode, u8 absolute flags and the operand: f64 number, u32 string or range index, i32 row, col reference.
+inline void writeProgram(WorkbookWriter& out, const ExprProgram& program, WorkbookStrings& strings) {
+    out.u32(strings.intern(program.strExpr));
+    out.i32(program.originRow);
+    out.i32(program.originCol);
+
+    out.u32(static_cast<uint32_t>(program.strings.size()));
+    for (const auto& str : program.strings) {
+        out.u32(strings.intern(str));
+    }
+
+    out.u32(static_cast<uint32_t>(program.ranges.size()));
+    for (const RangeOperand& range : program.ranges) {
+        out.u8(range.hAbs[0] | range.hAbs[1] << 1 | range.wAbs[0] << 2 | range.wAbs[1] << 3);
+        for (const RefOperand& corner : range.corner) {
+            out.i32(corner.posH);
+            out.i32(corner.posW);
+        }
+    }
+
+    out.u32(static_cast<uint32_t>(program.code.size()));
+    for (const Instruction& ins : program.code) {
+        out.u8(static_cast<uint8_t>(ins.op));
+        out.u8(ins.hAbs | ins.wAbs << 1);
+        switch (ins.op) {
+            case OpCode::PushNumber:
+                out.f64(ins.number);
+                break;
+            case OpCode::PushString:
+                out.u32(ins.stringIndex);
+                break;
+            case OpCode::PushRef:
+                out.i32(ins.ref.posH);
+                out.i32(ins.ref.posW);
+                break;
+            case OpCode::Sum:
+            case OpCode::Count:
+            case OpCode::Min:
+            case OpCode::Max:
+            case OpCode::CountVal:
+                out.u32(ins.rangeIndex);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Reads a program record, stringAt(index) returns the string of the table with the given index.
+template<typename StringAt>
+std::shared_ptr<ExprProgram> readProgram(WorkbookReader& in, StringAt&& stringAt, std::shared_ptr<std::pmr::memory_resource> arena) {
+    auto string = [&]() {
+        return stringAt(in.u32());
+    };
+
+    auto program = std::make_shared<ExprProgram>(std::move(arena));
+    program->strExpr = string();
+    program->originRow = in.i32();
+    program->originCol = in.i32();
+
+    uint32_t literals = in.count(4);
+    program->strings.reserve(literals);
+    for (uint32_t i = 0; i < literals; ++i) {
+        program->strings.emplace_back(string());
+    }
+
+    uint32_t ranges = in.count(17);
+    program->ranges.reserve(ranges);
+    for (uint32_t i = 0; i < ranges; ++i) {
+        RangeOperand range{};
+        uint8_t flags = in.u8();
+        range.hAbs[0] = flags & 1;
+        range.hAbs[1] = flags & 2;
+        range.wAbs[0] = flags & 4;
+        range.wAbs[1] = flags & 8;
+        for (RefOperand& corner : range.corner) {
+            corner.posH = in.i32();
+            corner.posW = in.i32();
+        }
+        program->ranges.push_back(range);
+    }
+
+    uint32_t instructions = in.count(2);
+    program->code.reserve(instructions);
+    for (uint32_t i = 0; i < instructions; ++i) {
+        Instruction ins{};
+        ins.op = static_cast<OpCode>(in.u8());
+        uint8_t flags = in.u8();
+        ins.hAbs = flags & 1;
+        ins.wAbs = flags & 2;
+        switch (ins.op) {
+            case OpCode::PushNumber:
+                ins.number = in.f64();
+                break;
+            case OpCode::PushString:
+                ins.stringIndex = in.u32();
+                break;
+            case OpCode::PushRef:
+                ins.ref.posH = in.i32();
+                ins.ref.posW = in.i32();
+                break;
+            case OpCode::Sum:
+            case OpCode::Count:
+            case OpCode::Min:
+            case OpCode::Max:
+            case OpCode::CountVal:
+                ins.rangeIndex = in.u32();
+                break;
+            default:
+                break;
+        }
+        program->code.push_back(ins);
+    }
+
+    if (!program->validate()) {
+        throw std::runtime_error("Malformed formula program");
+    }
+    return program;
+}
+
+// Random access view of a saved workbook. Every read is bounds checked and throws std::runtime_error
+// when the data is malformed, so the image may come straight from an untrusted file.
+class WorkbookImage {
+public:
+    struct Cell {
+        std::pair<int, int> pos;
+        uint8_t type;
+        bool cyclic;
+        uint64_t payload;
+    };
+    struct Tile {
+        std::pair<int, int> pos; // tile row and column
+        uint32_t first;
+        uint32_t count;
+        uint64_t checksum; // of its cell records
+    };
+
+    // Tile holding the cell in the directory.
+    static std::pair<int, int> tileOf(const std::pair<int, int>& pos) {
+        return {pos.first >> WORKBOOK_TILE_BITS, pos.second >> WORKBOOK_TILE_BITS};
+    }
+
+    explicit WorkbookImage(std::string_view data) : m_data(data) {
+        if (data.size() < WORKBOOK_HEADER_SIZE + sizeof(uint64_t)) {
+            throw std::runtime_error("Not a workbook");
+        }
+        m_body = data.substr(0, data.size() - sizeof(uint64_t));
+        WorkbookReader in(m_body);
+        if (in.bytes(sizeof(WORKBOOK_MAGIC)) != std::string_view(WORKBOOK_MAGIC, sizeof(WORKBOOK_MAGIC))
+            || in.u32() != WORKBOOK_VERSION) {
+            throw std::runtime_error("Not a workbook");
+        }
+        m_stringCount = in.u32();
+        m_programCount = in.u32();
+        m_tileCount = in.u32();
+        m_cellCount = in.u32();
+        m_strings = in.u64();
+        m_programs = in.u64();
+        m_tiles = in.u64();
+        m_cells = in.u64();
+        if (!fits(m_strings, m_stringCount, sizeof(uint64_t)) || !fits(m_programs, m_programCount, sizeof(uint64_t))
+            || !fits(m_tiles, m_tileCount, WORKBOOK_TILE_SIZE) || !fits(m_cells, m_cellCount, WORKBOOK_CELL_SIZE)) {
+            throw std::runtime_error("Section out of range");
+        }
+    }
+
+    bool checksumValid() const {
+        return WorkbookReader(m_data.substr(m_body.size())).u64() == workbookChecksum(m_body);
+    }
+
+    uint32_t stringCount() const {
+        return m_stringCount;
+    }
+    uint32_t programCount() const {
+        return m_programCount;
+    }
+    uint32_t tileCount() const {
+        return m_tileCount;
+    }
+    uint32_t cellCount() const {
+        return m_cellCount;
+    }
+
+    std::string_view string(uint64_t index) const {
+        if (index >= m_stringCount) {
+            throw std::runtime_error("String index out of range");
+        }
+        WorkbookReader in(m_body);
+        in.seek(m_strings + sizeof(uint64_t) * index);
+        in.seek(in.u64());
+        return in.bytes(in.u32());
+    }
+
+    std::shared_ptr<ExprProgram> program(uint64_t index, std::shared_ptr<std::pmr::memory_resource> arena) const {
+        if (index >= m_programCount) {
+            throw std::runtime_error("Program index out of range");
+        }
+        WorkbookReader in(m_body);
+        in.seek(m_programs + sizeof(uint64_t) * index);
+        in.seek(in.u64());
+        return readProgram(in, [this](uint64_t stringIndex) { return string(stringIndex); }, std::move(arena));
+    }
+
+    Cell cell(uint32_t index) const {
+        WorkbookReader in(m_body);
+        in.seek(m_cells + WORKBOOK_CELL_SIZE * index);
+        Cell cell;
+        cell.pos.first = in.i32();
+        cell.pos.second = in.i32();
+        uint8_t type = in.u8();
+        cell.type = type & ~WORKBOOK_CYCLIC;
+        cell.cyclic = type & WORKBOOK_CYCLIC;
+        cell.payload = in.u64();
+        return cell;
+    }
+
+    Tile tile(uint32_t index) const {
+        WorkbookReader in(m_body);
+        in.seek(m_tiles + WORKBOOK_TILE_SIZE * index);
+        Tile tile;
+        tile.pos.first = in.i32();
+        tile.pos.second = in.i32();
+        tile.first = in.u32();
+        tile.count = in.u32();
+        tile.checksum = in.u64();
+        if (tile.first > m_cellCount || tile.count > m_cellCount - tile.first) {
+            throw std::runtime_error("Tile out of range");
+        }
+        return tile;
+    }
+
+    // Checks the cell records of a tile against its checksum and its directory entry. The strings and
+    // programs they refer to are only checked when read.
+    bool tileValid(const Tile& tile) const {
+        WorkbookReader in(m_body);
+        in.seek(m_cells + WORKBOOK_CELL_SIZE * tile.first);
+        if (workbookChecksum(in.bytes(WORKBOOK_CELL_SIZE * tile.count)) != tile.checksum) {
+            return false;
+        }
+        for (uint32_t i = tile.first; i < tile.first + tile.count; ++i) {
+            Cell cell = this->cell(i);
+            if (tileOf(cell.pos) != tile.pos || (i > tile.first && !(position(i - 1) < cell.pos))
+                || (cell.type == TextCell && cell.payload >= m_stringCount)
+                || (cell.type == FormulaCell && cell.payload >= m_programCount)
+                || (cell.type != NumberCell && cell.type != TextCell && cell.type != FormulaCell)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Index of the first tile at or after the given tile in row-major order.
+    uint32_t tileLowerBound(const std::pair<int, int>& pos) const {
+        uint32_t lo = 0;
+        uint32_t hi = m_tileCount;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (tile(mid).pos < pos) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    // Index of the first cell of the tile at or after pos in row-major order.
+    uint32_t lowerBound(const Tile& tile, const std::pair<int, int>& pos) const {
+        uint32_t lo = tile.first;
+        uint32_t hi = tile.first + tile.count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (position(mid) < pos) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    // Finds the record of the cell at pos, a tile lookup followed by a search inside the tile.
+    std::optional<Cell> findCell(const std::pair<int, int>& pos) const {
+        uint32_t index = tileLowerBound(tileOf(pos));
+        if (index == m_tileCount) {
+            return std::nullopt;
+        }
+        Tile found = tile(index);
+        if (found.pos != tileOf(pos)) {
+            return std::nullopt;
+        }
+        uint32_t cellIndex = lowerBound(found, pos);
+        if (cellIndex == found.first + found.count) {
+            return std::nullopt;
+        }
+        Cell cell = this->cell(cellIndex);
+        if (cell.pos != pos) {
+            return std::nullopt;
+        }
+        return cell;
+    }
+
+private:
+    bool fits(uint64_t offset, uint64_t count, uint64_t elementSize) const {
+        return offset <= m_body.size() && count <= (m_body.size() - offset) / elementSize;
+    }
+    std::pair<int, int> position(uint32_t index) const {
+        WorkbookReader in(m_body);
+        in.seek(m_cells + WORKBOOK_CELL_SIZE * index);
+        int row = in.i32();
+        return {row, in.i32()};
+    }
+
+    std::string_view m_data;
+    std::string_view m_body;
+    uint32_t m_stringCount = 0;
+    uint32_t m_programCount = 0;
+    uint32_t m_tileCount = 0;
+    uint32_t m_cellCount = 0;
+    uint64_t m_strings = 0;
+    uint64_t m_programs = 0;
+    uint64_t m_tiles = 0;
+    uint64_t m_cells = 0;
+};
+
+// Everything a saved workbook holds, gathered from a sheet before it is laid out in either encoding.
+struct WorkbookContents {
+    WorkbookStrings strings;
+    WorkbookWriter programs;
+    // Offset of each program in programs
+    std::vector<uint64_t> programOffsets;
+    // Cells in no particular order
+    std::vector<WorkbookImage::Cell> cells;
+};
+
+#endif //VELKA_ULOHA_WORKBOOKFORMAT_H